@@ -0,0 +1,214 @@
+/* the descriptors of the dmac channel form a circular list, one per sector buffer, each of which
+ suspends the channel and raises an interrupt when its buffer is full. the isr resumes the channel
+ only if the next buffer has already been written to the card, so a full ring never overwrites
+ samples that have not been written, but instead leaves a counted gap. on a host, the channel is
+ replaced by acq_sim_sample(), and the card by sdcard_image.c */
+#include "acq.h"
+#include "samd51_sdcard.h"
+
+#include <assert.h>
+
+#if defined(__arm__)
+#if __has_include(<samd51.h>)
+/* newer cmsis-atmel from upstream */
+#include <samd51.h>
+#else
+/* older cmsis-atmel from adafruit */
+#include <samd.h>
+#endif
+#endif
+
+#ifndef ACQ_BUFFERS_MAX
+#define ACQ_BUFFERS_MAX 8
+#endif
+
+static struct acq_config config;
+
+/* the difference between these is the number of full buffers not yet written. these are only
+ ever incremented, the first by the isr and the second by acq_service() */
+static volatile unsigned long sectors_filled, sectors_written;
+static volatile unsigned long overruns;
+
+/* set when the isr has left the channel suspended because the ring was full */
+static volatile unsigned char stalled;
+
+/* cleared once the channel has filled the last block or has been stopped */
+static volatile unsigned char running;
+
+static void channel_resume(void);
+
+/* called at the end of each sector, with the channel suspended */
+static void sector_complete(void) {
+    const unsigned long filled = ++sectors_filled;
+
+    if (filled >= config.blocks) running = 0;
+    else if (filled - sectors_written >= config.buffer_count) {
+        stalled = 1;
+        overruns++;
+    }
+    else channel_resume();
+}
+
+#if defined(__arm__)
+#define IDMA_ACQ 3
+
+/* descriptors after the first, which lives in the dmac's own table */
+__attribute((aligned(16))) static DmacDescriptor descriptors[ACQ_BUFFERS_MAX - 1];
+
+static void channel_start(void) {
+    DmacDescriptor * first = ((DmacDescriptor *)DMAC->BASEADDR.bit.BASEADDR) + IDMA_ACQ;
+
+    const uint8_t beatsize = 4 == config.sample_bytes ? DMAC_BTCTRL_BEATSIZE_WORD_Val :
+                             2 == config.sample_bytes ? DMAC_BTCTRL_BEATSIZE_HWORD_Val :
+                             DMAC_BTCTRL_BEATSIZE_BYTE_Val;
+
+    for (size_t ibuffer = 0; ibuffer < config.buffer_count; ibuffer++) {
+        DmacDescriptor * descriptor = ibuffer ? descriptors + ibuffer - 1 : first;
+        DmacDescriptor * next = ibuffer + 1 < config.buffer_count ? descriptors + ibuffer : first;
+
+        *descriptor = (DmacDescriptor) {
+            .BTCNT.reg = 512 / config.sample_bytes,
+            .SRCADDR.reg = (size_t)config.source,
+            .DSTADDR.reg = ((size_t)config.buffers[ibuffer]) + 512,
+            .DESCADDR.reg = (size_t)next,
+            .BTCTRL = { .bit = {
+                .VALID = 1,
+                .BLOCKACT = DMAC_BTCTRL_BLOCKACT_BOTH_Val, /* suspend and interrupt */
+                .SRCINC = 0, /* read the same register every time */
+                .DSTINC = 1,
+                .BEATSIZE = beatsize,
+            }}
+        };
+    }
+
+    /* reset channel */
+    DMAC->Channel[IDMA_ACQ].CHCTRLA.bit.ENABLE = 0;
+    DMAC->Channel[IDMA_ACQ].CHCTRLA.bit.SWRST = 1;
+
+    DMAC->Channel[IDMA_ACQ].CHCTRLA.reg = (DMAC_CHCTRLA_Type) { .bit = {
+        .RUNSTDBY = 1,
+        .TRIGSRC = config.trigger,
+        .TRIGACT = DMAC_CHCTRLA_TRIGACT_BURST_Val, /* one burst per trigger */
+        .BURSTLEN = DMAC_CHCTRLA_BURSTLEN_SINGLE_Val /* one burst = one beat */
+    }}.reg;
+
+    DMAC->Channel[IDMA_ACQ].CHINTFLAG.reg = (DMAC_CHINTFLAG_Type) { .bit.TCMPL = 1, .bit.SUSP = 1 }.reg;
+    DMAC->Channel[IDMA_ACQ].CHINTENSET.reg = (DMAC_CHINTENSET_Type) { .bit.TCMPL = 1 }.reg;
+
+    NVIC_EnableIRQ(DMAC_3_IRQn);
+    NVIC_SetPriority(DMAC_3_IRQn, (1 << __NVIC_PRIO_BITS) - 1);
+
+    /* ensure changes to descriptors have propagated to sram prior to enabling peripheral */
+    __DSB();
+
+    DMAC->Channel[IDMA_ACQ].CHCTRLA.bit.ENABLE = 1;
+}
+
+static void channel_resume(void) {
+    DMAC->Channel[IDMA_ACQ].CHCTRLB.reg = (DMAC_CHCTRLB_Type) { .bit.CMD = DMAC_CHCTRLB_CMD_RESUME_Val }.reg;
+}
+
+static void channel_stop(void) {
+    DMAC->Channel[IDMA_ACQ].CHCTRLA.bit.ENABLE = 0;
+    NVIC_DisableIRQ(DMAC_3_IRQn);
+}
+
+static_assert(3 == IDMA_ACQ, "dmac channel isr mismatch");
+void DMAC_3_Handler(void) {
+    if (!DMAC->Channel[IDMA_ACQ].CHINTFLAG.bit.TCMPL) return;
+    DMAC->Channel[IDMA_ACQ].CHINTFLAG.reg = (DMAC_CHINTFLAG_Type) { .bit.TCMPL = 1, .bit.SUSP = 1 }.reg;
+
+    sector_complete();
+}
+
+#else
+/* state of the simulated channel */
+static size_t sim_offset;
+static unsigned char sim_suspended;
+
+static void channel_start(void) {
+    sim_offset = 0;
+    sim_suspended = 0;
+}
+
+static void channel_resume(void) {
+    sim_suspended = 0;
+}
+
+static void channel_stop(void) {
+    sim_suspended = 1;
+}
+
+void acq_sim_sample(const void * sample) {
+    /* samples arriving while the channel is suspended are lost, as they would be on hardware */
+    if (!running || sim_suspended) return;
+
+    unsigned char * buffer = (unsigned char *)config.buffers[sectors_filled % config.buffer_count];
+    __builtin_memcpy(buffer + sim_offset, sample, config.sample_bytes);
+    sim_offset += config.sample_bytes;
+
+    if (512 == sim_offset) {
+        sim_offset = 0;
+        sim_suspended = 1;
+        sector_complete();
+    }
+}
+#endif
+
+int acq_start(const struct acq_config * new_config) {
+    if (new_config->buffer_count < 2 || new_config->buffer_count > ACQ_BUFFERS_MAX ||
+        !new_config->blocks || (new_config->sample_bytes != 1 && new_config->sample_bytes != 2 &&
+                                new_config->sample_bytes != 4))
+        return -1;
+
+    config = *new_config;
+    sectors_filled = 0;
+    sectors_written = 0;
+    overruns = 0;
+    stalled = 0;
+    running = 1;
+
+    channel_start();
+    return 0;
+}
+
+long acq_service(void) {
+    const unsigned long written = sectors_written, waiting = sectors_filled - written;
+    if (!waiting) return 0;
+
+    /* the full buffers, which may wrap around the end of the ring */
+    const size_t first = written % config.buffer_count;
+    const unsigned long until_end = config.buffer_count - first;
+    const unsigned long before_wrap = waiting < until_end ? waiting : until_end;
+
+    const struct spi_sd_write_segment segments[2] = {
+        { .buf = config.buffers[first], .blocks = before_wrap },
+        { .buf = config.buffers[0], .blocks = waiting - before_wrap }
+    };
+
+    if (-1 == spi_sd_write_blocks_vectored(segments, 2, config.first_block + written)) return -1;
+
+    /* if the isr found no free buffer at the last sector boundary, there is one now */
+    sectors_written = written + waiting;
+    if (stalled && running) {
+        stalled = 0;
+        channel_resume();
+    }
+
+    return waiting;
+}
+
+int acq_stop(void) {
+    channel_stop();
+    running = 0;
+
+    return -1 == acq_service() ? -1 : 0;
+}
+
+void acq_stats_get(struct acq_stats * out) {
+    *out = (struct acq_stats) {
+        .sectors_filled = sectors_filled,
+        .sectors_written = sectors_written,
+        .overruns = overruns
+    };
+}
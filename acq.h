@@ -0,0 +1,55 @@
+/* acquisition pipeline in which a dmac channel moves samples from a peripheral into a ring of
+ sector buffers, and full sectors are written to consecutive blocks on the card, such that the
+ cpu is only involved at sector boundaries */
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct acq_config {
+    /* ring of word aligned sector buffers, at least two and at most ACQ_BUFFERS_MAX */
+    uint32_t (* buffers)[128];
+    size_t buffer_count;
+
+    /* blocks on the card to fill, e.g. those of a file preallocated with f_expand() */
+    unsigned long long first_block;
+    unsigned long blocks;
+
+    /* dmac trigger source of the peripheral, e.g. that of an adc result being ready, and the
+     address and size in bytes (1, 2, or 4) of the register each sample is moved from */
+    uint8_t trigger;
+    const volatile void * source;
+    uint8_t sample_bytes;
+};
+
+struct acq_stats {
+    unsigned long sectors_filled, sectors_written;
+
+    /* times the ring was found full at a sector boundary, each of which leaves a gap in the
+     samples until a buffer has been written and the dmac channel resumed */
+    unsigned long overruns;
+};
+
+/* the card must already have been initialized. the dmac channel starts right away */
+int acq_start(const struct acq_config * config);
+
+/* writes all full sectors to the card as a single cmd25, and returns how many, or -1 on error.
+ should be called at least once per ring's worth of samples. blocking, calls yield() */
+long acq_service(void);
+
+/* stops the dmac channel and writes any remaining full sectors. the sector being filled at the
+ time is discarded */
+int acq_stop(void);
+
+void acq_stats_get(struct acq_stats * out);
+
+#if !defined(__arm__)
+/* on a host, stands in for the dmac moving one sample from the peripheral */
+void acq_sim_sample(const void * sample);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,105 @@
+/* host-side test of the acquisition ring, with the dmac channel replaced by acq_sim_sample()
+ and the card by a scratch image. exits nonzero on failure. build e.g. with:
+ cc -O2 acq_test.c acq.c sdcard_image.c -o acq_test && ./acq_test */
+#include "acq.h"
+#include "samd51_sdcard.h"
+#include "sdcard_image.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define RING_BUFFERS 4
+#define FIRST_BLOCK 2000
+#define BLOCKS 40
+
+/* 256 samples per sector */
+#define SECTOR_SAMPLES (512 / sizeof(uint16_t))
+
+static size_t failures = 0;
+
+#define CHECK(cond) do { if (!(cond)) { fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); failures++; } } while(0)
+
+static uint32_t ring[RING_BUFFERS][128];
+
+/* the next sample to be generated, such that each sample is its own index */
+static uint16_t next_sample = 0;
+
+static void generate(const size_t samples, const size_t service_every) {
+    for (size_t isample = 0; isample < samples; isample++) {
+        acq_sim_sample(&next_sample);
+        next_sample++;
+        if (service_every && isample % service_every == service_every - 1)
+            CHECK(acq_service() != -1);
+    }
+}
+
+int main(void) {
+    char path[] = "/tmp/acq_test_XXXXXX";
+    const int fd = mkstemp(path);
+    if (-1 == fd || ftruncate(fd, 512 * (FIRST_BLOCK + BLOCKS)) != 0 || -1 == sdcard_image_open(path)) {
+        perror(path);
+        return 1;
+    }
+    close(fd);
+
+    const struct acq_config config = {
+        .buffers = ring, .buffer_count = RING_BUFFERS,
+        .first_block = FIRST_BLOCK, .blocks = BLOCKS,
+        .sample_bytes = sizeof(uint16_t)
+    };
+    CHECK(0 == acq_start(&config));
+
+    /* serviced every three sectors, the ring never fills, and each service is one cmd25 */
+    const size_t commands_before = sdcard_image_write_commands;
+    generate(10 * SECTOR_SAMPLES, 3 * SECTOR_SAMPLES);
+    CHECK(1 == acq_service());
+
+    struct acq_stats stats;
+    acq_stats_get(&stats);
+    CHECK(10 == stats.sectors_filled && 10 == stats.sectors_written && !stats.overruns);
+    CHECK(4 == sdcard_image_write_commands - commands_before);
+
+    static uint16_t readback[BLOCKS * SECTOR_SAMPLES];
+    CHECK(0 == spi_sd_read_blocks(readback, 10, FIRST_BLOCK));
+    for (size_t isample = 0; isample < 10 * SECTOR_SAMPLES; isample++)
+        if (readback[isample] != isample) {
+            CHECK(readback[isample] == isample);
+            break;
+        }
+
+    /* unserviced, the channel stalls once every buffer is full, rather than overwriting any,
+     and the samples arriving meanwhile are lost */
+    generate(8 * SECTOR_SAMPLES, 0);
+    acq_stats_get(&stats);
+    CHECK(10 + RING_BUFFERS == stats.sectors_filled && 10 == stats.sectors_written && 1 == stats.overruns);
+
+    /* a service writes the whole ring, wrapping around its end, and resumes the channel */
+    CHECK(RING_BUFFERS == acq_service());
+    const uint16_t resumed_at = next_sample;
+    generate(SECTOR_SAMPLES, 0);
+    CHECK(1 == acq_service());
+    acq_stats_get(&stats);
+    CHECK(11 + RING_BUFFERS == stats.sectors_written && 1 == stats.overruns);
+
+    /* what reached the card is contiguous up to the gap, and resumes with the next sample */
+    CHECK(0 == spi_sd_read_blocks(readback, 10 + RING_BUFFERS + 1, FIRST_BLOCK));
+    for (size_t isample = 0; isample < (10 + RING_BUFFERS) * SECTOR_SAMPLES; isample++)
+        if (readback[isample] != isample) {
+            CHECK(readback[isample] == isample);
+            break;
+        }
+    CHECK(readback[(10 + RING_BUFFERS) * SECTOR_SAMPLES] == resumed_at);
+
+    /* the channel stops by itself at the last block, and later samples go nowhere */
+    generate(BLOCKS * SECTOR_SAMPLES, SECTOR_SAMPLES);
+    CHECK(0 == acq_stop());
+    acq_stats_get(&stats);
+    CHECK(BLOCKS == stats.sectors_filled && BLOCKS == stats.sectors_written && 1 == stats.overruns);
+
+    sdcard_image_close();
+    unlink(path);
+
+    if (failures) fprintf(stderr, "%zu failures\n", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,36 @@
+/* splits long writes through fatfs so that other tasks waiting on the fatfs volume lock, which
+ fatfs holds for the duration of each call, get a turn between bursts */
+#include "burstwrite.h"
+#include "fastseek.h"
+
+extern void yield(void);
+
+FRESULT burstwrite(FIL * fp, const void * buf, UINT btw, UINT * bw, UINT burst_bytes) {
+    const unsigned char * cursor = buf;
+    *bw = 0;
+
+    /* a burst of less than a sector would leave fatfs copying through its own buffer */
+    burst_bytes = burst_bytes / FF_MAX_SS * FF_MAX_SS;
+    if (!burst_bytes) return f_write(fp, buf, btw, bw);
+
+    while (btw) {
+        /* end each burst on a multiple of the burst size within the file, so that after a first
+         partial burst, bursts stay aligned to whole sectors and to each other */
+        const UINT to_boundary = burst_bytes - f_tell(fp) % burst_bytes;
+        const UINT this_btw = btw < to_boundary ? btw : to_boundary;
+
+        /* fastseek_write behaves as f_write on files which were not attached */
+        UINT this_bw;
+        const FRESULT res = fastseek_write(fp, cursor, this_btw, &this_bw);
+        *bw += this_bw;
+        if (res != FR_OK || this_bw != this_btw) return res;
+
+        cursor += this_bw;
+        btw -= this_bw;
+
+        /* fatfs has released the volume lock, so let anything waiting on it have a turn */
+        if (btw) yield();
+    }
+
+    return FR_OK;
+}
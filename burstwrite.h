@@ -0,0 +1,17 @@
+/* long writes through fatfs in bursts, between which other tasks may use the same volume */
+#include "ff.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* like f_write, but in bursts of at most burst_bytes, rounded down to whole sectors, which end
+ on multiples of burst_bytes within the file. fatfs holds its volume lock for the whole of each
+ f_write, so an f_read on the same volume otherwise waits for all of a long write regardless of
+ spi_sd_set_read_latency_bound. between bursts the lock is released and yield() is called, so
+ such a read waits for at most one burst. works on files attached with fastseek_attach */
+FRESULT burstwrite(FIL * fp, const void * buf, UINT btw, UINT * bw, UINT burst_bytes);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,26 @@
+/* minimal lock for cooperative concurrency built on yield(). the test-and-set is atomic, so
+ these are also safe against preemption, although a preempted waiter will merely spin */
+#include <stdint.h>
+
+extern void yield(void);
+
+struct coop_lock {
+    volatile unsigned char held;
+};
+
+static inline int coop_lock_try(struct coop_lock * lock) {
+    return !__atomic_test_and_set(&lock->held, __ATOMIC_ACQUIRE);
+}
+
+static inline void coop_lock_take(struct coop_lock * lock) {
+    while (!coop_lock_try(lock)) yield();
+}
+
+/* also sets the event register, so that a runtime which sleeps when no task is polling does
+ not sleep through the wakeup of a waiter, which yields without doing so */
+static inline void coop_lock_give(struct coop_lock * lock) {
+    __atomic_clear(&lock->held, __ATOMIC_RELEASE);
+#if defined(__arm__)
+    __asm__ volatile ("sev" ::: "memory");
+#endif
+}
@@ -7,8 +7,11 @@
 /* block device implementation code being wrapped by this */
 #include "samd51_sdcard.h"
 
-/* needed for INT_MAX, this will go away */
-#include <limits.h>
+/* optional extras implemented in this file */
+#include "diskio_extras.h"
+
+/* fatfs only serializes calls per volume, this also covers callers of the extras */
+#include "coop_lock.h"
 
 #include <stdio.h>
 
@@ -18,51 +21,218 @@ __attribute((weak)) unsigned char verbose = 0;
 
 unsigned char diskio_initted = 0;
 
+/* protects the block cache and the deferred fill run, held for the duration of each call, except
+ while a long write has been preempted by samd51_sdcard.c on behalf of a waiting reader */
+static struct coop_lock diskio_lock;
+
+/* set while this layer has a multi-block write open, and while such a write is preempted */
+static unsigned char write_open = 0, write_preempted = 0;
+
+/* range of sectors being written by the open write */
+static LBA_t write_open_sector;
+static UINT write_open_count;
+
+/* readers announce themselves to the card layer while they wait, so that it can preempt a
+ long write on their behalf, which in turn gives up this lock via the hooks below */
+static void take_lock_for_read(void) {
+    if (coop_lock_try(&diskio_lock)) return;
+
+    spi_sd_reader_waiting();
+    coop_lock_take(&diskio_lock);
+    spi_sd_reader_done_waiting();
+}
+
+/* anything which may write waits for a preempted write to finish first */
+static void take_lock_for_write(void) {
+    while (1) {
+        coop_lock_take(&diskio_lock);
+        if (!write_preempted) return;
+        coop_lock_give(&diskio_lock);
+        yield();
+    }
+}
+
 DSTATUS disk_status(BYTE pdrv) {
     (void)pdrv;
     return diskio_initted ? 0 : STA_NOINIT;
 }
 
-static LBA_t block_cache_sectors[64];
-static unsigned char block_cache[64][512];
-static const size_t B = sizeof(block_cache) / sizeof(block_cache[0]);
+#ifndef DISKIO_CACHE_BLOCKS
+#define DISKIO_CACHE_BLOCKS 64
+#endif
+
+/* pool of sector buffers which serves as the block cache. an entry with a nonzero reference
+ count is pinned, and is neither evicted nor overwritten. an entry whose sector is written or
+ erased while it is pinned becomes stale, and is freed when its last reference is released */
+static struct cache_entry {
+    LBA_t sector; /* zero if the entry is free, as sector zero is never cached */
+    unsigned short refs;
+    unsigned char stale;
+} cache_entries[DISKIO_CACHE_BLOCKS];
+
+/* word aligned so that entries can be filled directly by dma */
+static uint32_t cache_data[DISKIO_CACHE_BLOCKS][128];
+
+static const size_t B = DISKIO_CACHE_BLOCKS;
 static size_t icache = 0;
 
+#ifdef DISKIO_TRACE
+#ifndef DISKIO_TRACE_RECORDS
+#define DISKIO_TRACE_RECORDS 256
+#endif
+
+static struct diskio_trace_record trace_records[DISKIO_TRACE_RECORDS];
+static size_t trace_head = 0, trace_tail = 0;
+size_t diskio_trace_dropped = 0;
+
+/* state of the call currently being traced, accumulated by the code below */
+static unsigned char trace_flags = 0, trace_retries = 0;
+static uint32_t trace_arg = 0;
+
+/* application may provide a free-running clock in whatever units it likes */
+__attribute((weak)) uint32_t diskio_trace_clock(void) { return 0; }
+
+static void trace_record(const unsigned char op, const DRESULT res, const LBA_t sector, const UINT count, const uint32_t start) {
+    /* if the ring is full, overwrite the oldest record and remember that we did */
+    if (trace_head - trace_tail == DISKIO_TRACE_RECORDS) {
+        trace_tail++;
+        diskio_trace_dropped++;
+    }
+
+    trace_records[trace_head % DISKIO_TRACE_RECORDS] = (struct diskio_trace_record) {
+        .sector = sector,
+        .duration = diskio_trace_clock() - start,
+        .count = count,
+        .op = op,
+        .flags = trace_flags | (res ? DISKIO_TRACE_ERROR : 0) | (trace_retries < 15 ? trace_retries : 15),
+        .arg = trace_arg
+    };
+    trace_head++;
+}
+
+size_t diskio_trace_drain(struct diskio_trace_record * out, size_t max) {
+    size_t ret = 0;
+    for (; ret < max && trace_tail != trace_head; ret++, trace_tail++)
+        out[ret] = trace_records[trace_tail % DISKIO_TRACE_RECORDS];
+    return ret;
+}
+
+#define TRACE_FLAG(x) do { trace_flags |= (x); } while(0)
+#define TRACE_RETRY() do { trace_retries++; } while(0)
+#define TRACE_ARG(x) do { trace_arg = (x); } while(0)
+
+#define TRACED(res, op, sector, count, call) do { \
+    trace_flags = 0; \
+    trace_retries = 0; \
+    trace_arg = 0; \
+    const uint32_t trace_start = diskio_trace_clock(); \
+    res = call; \
+    trace_record(op, res, sector, count, trace_start); \
+} while(0)
+#else
+#define TRACE_FLAG(x) do { } while(0)
+#define TRACE_RETRY() do { } while(0)
+#define TRACE_ARG(x) do { } while(0)
+#define TRACED(res, op, sector, count, call) do { res = call; } while(0)
+#endif
+
+/* as spi_sd_write_blocks, but marks the write as belonging to this layer while it is open. if
+ buff is null, each block is the given word repeated */
+static int write_blocks(const BYTE * buff, const uint32_t fill, const UINT count, const LBA_t sector) {
+    if (-1 == spi_sd_write_blocks_start(sector)) return -1;
+
+    write_open = 1;
+    write_open_sector = sector;
+    write_open_count = count;
+
+    const int ret = buff ? spi_sd_write_some_blocks(buff, count) : spi_sd_write_some_blocks_fill(fill, count);
+    write_open = 0;
+
+    if (-1 == ret) return -1;
+
+    spi_sd_write_blocks_end();
+    return 0;
+}
+
 DSTATUS disk_initialize(BYTE pdrv) {
     (void)pdrv;
+    take_lock_for_write();
+
     if (!diskio_initted) {
         for (size_t ipass = 0;; ipass++) {
-            if (ipass > 0 && verbose >= 1)
-                dprintf(2, "%s: retrying at lower baud rate %u\r\n", __func__, (unsigned)ipass + 1);
-            if (spi_sd_init(ipass) != -1) break;
-            if (ipass > 3) return STA_NOINIT;
+            if (ipass > 0) {
+                spi_sd_stats.retries[SPI_SD_OP_INIT]++;
+                if (verbose >= 1)
+                    dprintf(2, "%s: retrying at lower baud rate %u\r\n", __func__, (unsigned)ipass + 1);
+            }
+            if (spi_sd_init(ipass) != -1) {
+                if (ipass > 0) spi_sd_stats.baud_reductions[SPI_SD_OP_INIT]++;
+                break;
+            }
+            if (ipass > 3) {
+                coop_lock_give(&diskio_lock);
+                return STA_NOINIT;
+            }
         }
         spi_sd_restore_baud_rate();
     }
 
-    __builtin_memset(block_cache_sectors, 0, sizeof(block_cache_sectors));
+    for (size_t icache_search = 0; icache_search < B; icache_search++)
+        if (!cache_entries[icache_search].refs)
+            cache_entries[icache_search] = (struct cache_entry) { 0 };
+        else
+            cache_entries[icache_search].stale = 1;
 
     diskio_initted = 1;
+    coop_lock_give(&diskio_lock);
     return 0;
 }
 
-static LBA_t deferred_zeros_sector_start = 0;
-static UINT deferred_zeros_sector_count = 0;
+/* run of sectors, each of which is the same 32-bit word repeated, usually zeros, which has been
+ written by fatfs but not yet sent to the card */
+static LBA_t deferred_fill_sector_start = 0;
+static UINT deferred_fill_sector_count = 0;
+static uint32_t deferred_fill_word = 0;
 
-static DRESULT flush_deferred_zeros(void) {
-    const UINT count = deferred_zeros_sector_count;
-    deferred_zeros_sector_count = 0;
+/* a deferred run may be many allocation units long, so it is written as one cmd25 per
+ allocation unit or part thereof, each retried on its own */
+static DRESULT write_fill(const LBA_t sector, const UINT count) {
+    for (UINT done = 0, burst; done < count; done += burst) {
+        burst = spi_sd_plan_burst(sector + done, count - done);
 
+        for (size_t ipass = 0;; ipass++) {
+            if (ipass > 0) {
+                TRACE_RETRY();
+                spi_sd_stats.retries[SPI_SD_OP_WRITE]++;
+                if (verbose >= 1)
+                    dprintf(2, "%s: retrying at lower baud rate %u\r\n", __func__, (unsigned)ipass + 1);
+                if (-1 == spi_sd_init(ipass)) continue;
+                spi_sd_stats.baud_reductions[SPI_SD_OP_WRITE]++;
+            }
+
+            fatfs_sectors_written += burst;
+
+            if (write_blocks(NULL, deferred_fill_word, burst, sector + done) != -1) break;
+            if (ipass > 3) return RES_ERROR;
+        }
+    }
+
+    spi_sd_restore_baud_rate();
+    return 0;
+}
+
+static DRESULT erase(const LBA_t sector, const UINT count) {
     for (size_t ipass = 0;; ipass++) {
         if (ipass > 0) {
+            TRACE_RETRY();
+            spi_sd_stats.retries[SPI_SD_OP_ERASE]++;
             if (verbose >= 1)
                 dprintf(2, "%s: retrying at lower baud rate %u\r\n", __func__, (unsigned)ipass + 1);
             if (-1 == spi_sd_init(ipass)) continue;
+            spi_sd_stats.baud_reductions[SPI_SD_OP_ERASE]++;
         }
 
-        fatfs_sectors_written += count;
-
-        if (spi_sd_write_blocks(NULL, count, deferred_zeros_sector_start) != -1) break;
+        if (spi_sd_erase_blocks(sector, count) != -1) break;
         if (ipass > 3) return RES_ERROR;
     }
 
@@ -70,42 +240,169 @@ static DRESULT flush_deferred_zeros(void) {
     return 0;
 }
 
-static void cache_block(const BYTE * buff, LBA_t sector) {
+static void report_watched_failure(const LBA_t sector, const LBA_t count);
+
+static DRESULT flush_deferred_fill(void) {
+    const LBA_t start = deferred_fill_sector_start, end = start + deferred_fill_sector_count;
+    TRACE_FLAG(DISKIO_TRACE_FLUSHED_FILL);
+
+    /* if the run is of whatever the card erases to, any whole allocation units within it are
+     erased rather than written, which is much faster and does not add to the card's write
+     amplification */
+    LBA_t erase_start = end, erase_end = end;
+    const unsigned long au = spi_sd_au_blocks();
+    if (au && deferred_fill_word == spi_sd_erase_fill() * 0x01010101U && (start + au - 1) / au < end / au) {
+        erase_start = (start + au - 1) / au * au;
+        erase_end = end / au * au;
+    }
+
+    /* the run remains in place until it has been written, so that readers let in while one of
+     these writes is preempted still see its contents */
+    DRESULT res = 0;
+    if ((erase_start > start && (res = write_fill(start, erase_start - start))) ||
+        (erase_end > erase_start && (res = erase(erase_start, erase_end - erase_start))) ||
+        (end > erase_end && (res = write_fill(erase_end, end - erase_end)))) {
+        /* the writes absorbed into the run were reported as having succeeded */
+        report_watched_failure(start, end - start);
+        return res;
+    }
+
+    deferred_fill_sector_count = 0;
+    return 0;
+}
+
+static size_t cache_lookup(const LBA_t sector) {
     for (size_t icache_search = 0; icache_search < B; icache_search++)
-        if (sector && block_cache_sectors[icache_search] == sector) {
-            icache = icache_search;
-            break;
-        }
+        if (sector && cache_entries[icache_search].sector == sector && !cache_entries[icache_search].stale)
+            return icache_search;
+    return B;
+}
+
+/* empties and returns the next unpinned entry in round robin order, or B if all are pinned */
+static size_t cache_claim(void) {
+    for (size_t ipass = 0; ipass < B; ipass++) {
+        struct cache_entry * entry = cache_entries + icache;
+        const size_t ientry = icache;
+        icache = (icache + 1) % B;
+
+        if (entry->refs) continue;
+        if (entry->sector && !entry->stale) spi_sd_stats.cache_evictions++;
 
-    __builtin_memcpy(block_cache[icache], buff, 512);
-    block_cache_sectors[icache] = sector;
-    icache = (icache + 1) % B;
+        *entry = (struct cache_entry) { 0 };
+        return ientry;
+    }
+    return B;
 }
 
-DRESULT disk_read(BYTE pdrv, BYTE * buff, LBA_t sector, UINT count) {
-    (void)pdrv;
+static void uncache_blocks(const LBA_t sector, const UINT count) {
+    for (size_t icache_search = 0; icache_search < B; icache_search++) {
+        struct cache_entry * entry = cache_entries + icache_search;
+        if (!entry->sector || entry->sector < sector || entry->sector - sector >= count) continue;
 
-    if (deferred_zeros_sector_count) {
-        const DRESULT res = flush_deferred_zeros();
-        if (res) return res;
+        if (entry->refs) entry->stale = 1;
+        else entry->sector = 0;
     }
+}
 
-    for (size_t icache_search = 0; icache_search < B; icache_search++)
-        if (1 == count && sector && block_cache_sectors[icache_search] == sector) {
-            if (verbose >= 2)
-                dprintf(2, "%s(%d): reusing cached block %u at %u\r\n", __func__, __LINE__, (unsigned)sector, icache_search);
-            __builtin_memcpy(buff, block_cache[icache_search], 512);
-            return 0;
-        }
+#ifdef DISKIO_TRACE
+/* readers served while a write is preempted are traced as usual, so save what the write had */
+static unsigned char preempted_trace_flags, preempted_trace_retries;
+static uint32_t preempted_trace_arg;
+#endif
+
+/* called by samd51_sdcard.c when it hands the bus to waiting readers in the middle of a write.
+ only writes started by this layer hold this layer's lock */
+void spi_sd_write_preempted_hook(void) {
+    if (!write_open) return;
+
+#ifdef DISKIO_TRACE
+    preempted_trace_flags = trace_flags;
+    preempted_trace_retries = trace_retries;
+    preempted_trace_arg = trace_arg;
+#endif
+
+    write_preempted = 1;
+    coop_lock_give(&diskio_lock);
+}
+
+void spi_sd_write_resuming_hook(void) {
+    if (!write_open) return;
+
+    coop_lock_take(&diskio_lock);
+    write_preempted = 0;
+
+    /* readers may have cached what was there before, in the part not yet written */
+    uncache_blocks(write_open_sector, write_open_count);
+
+#ifdef DISKIO_TRACE
+    trace_flags = preempted_trace_flags;
+    trace_retries = preempted_trace_retries;
+    trace_arg = preempted_trace_arg;
+#endif
+}
+
+static void cache_block(const BYTE * buff, LBA_t sector) {
+    if (!sector) return;
+
+    size_t ientry = cache_lookup(sector);
+    if (ientry != B && cache_entries[ientry].refs) {
+        /* leave the pinned copy alone for whoever holds it */
+        cache_entries[ientry].stale = 1;
+        ientry = B;
+    }
+
+    if (B == ientry && B == (ientry = cache_claim())) return;
+
+    __builtin_memcpy(cache_data[ientry], buff, 512);
+    cache_entries[ientry].sector = sector;
+}
+
+/* sectors within the deferred run are filled in from its word without the run being flushed, so
+ that reads never have to write anything first */
+static int sector_is_deferred_fill(const LBA_t sector) {
+    return deferred_fill_sector_count && sector >= deferred_fill_sector_start &&
+        sector - deferred_fill_sector_start < deferred_fill_sector_count;
+}
+
+static void fill_sector(void * buff) {
+    for (size_t iword = 0; iword < 128; iword++)
+        __builtin_memcpy((BYTE *)buff + 4 * iword, &deferred_fill_word, 4);
+}
+
+static DRESULT read_sectors(BYTE * buff, LBA_t sector, UINT count) {
+    UINT deferred = 0;
+    for (UINT isector = 0; isector < count; isector++)
+        if (sector_is_deferred_fill(sector + isector)) deferred++;
+
+    if (deferred == count) {
+        for (UINT isector = 0; isector < count; isector++)
+            fill_sector(buff + 512 * isector);
+        return 0;
+    }
+
+    const size_t ientry = 1 == count ? cache_lookup(sector) : B;
+    if (ientry != B) {
+        if (verbose >= 2)
+            dprintf(2, "%s(%d): reusing cached block %u at %u\r\n", __func__, __LINE__, (unsigned)sector, (unsigned)ientry);
+        __builtin_memcpy(buff, cache_data[ientry], 512);
+        TRACE_FLAG(DISKIO_TRACE_CACHE_HIT);
+        spi_sd_stats.cache_hits++;
+        return 0;
+    }
+
+    if (1 == count) spi_sd_stats.cache_misses++;
 
     if (verbose >= 2)
         dprintf(2, "%s(%d): reading %u blocks starting at %u\r\n", __func__, __LINE__, count, (unsigned)sector);
 
     for (size_t ipass = 0;; ipass++) {
         if (ipass > 0) {
+            TRACE_RETRY();
+            spi_sd_stats.retries[SPI_SD_OP_READ]++;
             if (verbose >= 1)
                 dprintf(2, "%s: retrying at lower baud rate %u\r\n", __func__, (unsigned)ipass + 1);
             if (-1 == spi_sd_init(ipass)) continue;
+            spi_sd_stats.baud_reductions[SPI_SD_OP_READ]++;
         }
 
         fatfs_sectors_read += count;
@@ -115,32 +412,198 @@ DRESULT disk_read(BYTE pdrv, BYTE * buff, LBA_t sector, UINT count) {
         if (ipass > 3) return RES_ERROR;
     }
 
+    if (deferred)
+        for (UINT isector = 0; isector < count; isector++)
+            if (sector_is_deferred_fill(sector + isector))
+                fill_sector(buff + 512 * isector);
+
     cache_block(buff, sector);
 
     spi_sd_restore_baud_rate();
     return 0;
 }
 
-static int buffer_points_to_all_zeros(const BYTE * buff, UINT count) {
-    for (size_t ibyte = 0; ibyte < 512 * count; ibyte++)
-        if (buff[ibyte]) return 0;
-    return 1;
+DRESULT disk_read(BYTE pdrv, BYTE * buff, LBA_t sector, UINT count) {
+    (void)pdrv;
+    take_lock_for_read();
+
+    DRESULT res;
+    TRACED(res, DISKIO_TRACE_READ, sector, count, read_sectors(buff, sector, count));
+
+    coop_lock_give(&diskio_lock);
+    return res;
 }
 
-DRESULT disk_write(BYTE pdrv, const BYTE * buff, LBA_t sector, UINT count) {
+static DRESULT read_pinned(LBA_t sector, const void ** view) {
+    *view = NULL;
+
+    size_t ientry = cache_lookup(sector);
+    if (ientry != B) {
+        cache_entries[ientry].refs++;
+        *view = cache_data[ientry];
+        TRACE_FLAG(DISKIO_TRACE_CACHE_HIT);
+        spi_sd_stats.cache_hits++;
+        return 0;
+    }
+
+    spi_sd_stats.cache_misses++;
+
+    /* if every entry is pinned, the caller will have to use disk_read instead */
+    ientry = cache_claim();
+    if (B == ientry) return RES_NOTRDY;
+
+    /* pin it while it is being filled. it is not visible to lookups until its sector is set */
+    cache_entries[ientry].refs = 1;
+
+    if (sector_is_deferred_fill(sector)) {
+        fill_sector(cache_data[ientry]);
+        cache_entries[ientry].sector = sector;
+        *view = cache_data[ientry];
+        return 0;
+    }
+
+    for (size_t ipass = 0;; ipass++) {
+        if (ipass > 0) {
+            TRACE_RETRY();
+            spi_sd_stats.retries[SPI_SD_OP_READ]++;
+            if (verbose >= 1)
+                dprintf(2, "%s: retrying at lower baud rate %u\r\n", __func__, (unsigned)ipass + 1);
+            if (-1 == spi_sd_init(ipass)) continue;
+            spi_sd_stats.baud_reductions[SPI_SD_OP_READ]++;
+        }
+
+        fatfs_sectors_read++;
+
+        /* dma straight into the pool entry */
+        if (spi_sd_read_blocks(cache_data[ientry], 1, sector) != -1) break;
+        if (ipass > 3) {
+            cache_entries[ientry].refs = 0;
+            return RES_ERROR;
+        }
+    }
+
+    /* sector zero is never cached, but can still be pinned */
+    cache_entries[ientry].sector = sector;
+    *view = cache_data[ientry];
+
+    spi_sd_restore_baud_rate();
+    return 0;
+}
+
+const void * disk_read_pinned(BYTE pdrv, LBA_t sector) {
+    (void)pdrv;
+    take_lock_for_read();
+
+    DRESULT res;
+    const void * view;
+    TRACED(res, DISKIO_TRACE_READ, sector, 1, read_pinned(sector, &view));
+    (void)res;
+
+    coop_lock_give(&diskio_lock);
+    return view;
+}
+
+void disk_release(BYTE pdrv, const void * view) {
     (void)pdrv;
+    if (!view) return;
+
+    take_lock_for_read();
+
+    struct cache_entry * entry = cache_entries + ((const uint32_t (*)[128])view - cache_data);
+    if (!--entry->refs && entry->stale)
+        *entry = (struct cache_entry) { 0 };
+
+    coop_lock_give(&diskio_lock);
+}
+
+/* range of sectors whose writes are reported to diskio_watched_write_hook(), if count is nonzero */
+static LBA_t watch_sector_start = 0, watch_sector_count = 0;
+
+void diskio_watch(LBA_t sector, LBA_t count) {
+    take_lock_for_write();
+    watch_sector_start = sector;
+    watch_sector_count = count;
+    coop_lock_give(&diskio_lock);
+}
+
+__attribute((weak)) int diskio_watched_write_hook(LBA_t sector, const void * before, const void * after) {
+    (void)sector;
+    (void)before;
+    (void)after;
+    return 0;
+}
+
+/* the previous contents of a sector are known without reading the card if they are cached.
+ returns -1 as soon as the hook refuses one of the sectors, which are then not written at all */
+static int report_watched_writes(const BYTE * buff, const LBA_t sector, const UINT count) {
+    for (UINT isector = 0; isector < count; isector++) {
+        const LBA_t watched = sector + isector;
+        if (watched < watch_sector_start || watched - watch_sector_start >= watch_sector_count) continue;
+
+        const size_t ientry = cache_lookup(watched);
+        if (-1 == diskio_watched_write_hook(watched, ientry != B ? cache_data[ientry] : NULL, buff + 512 * isector))
+            return -1;
+    }
+    return 0;
+}
+
+/* sectors already reported which may not have been written as reported */
+static void report_watched_failure(const LBA_t sector, const LBA_t count) {
+    for (LBA_t isector = 0; watch_sector_count && isector < count; isector++) {
+        const LBA_t watched = sector + isector;
+        if (watched < watch_sector_start || watched - watch_sector_start >= watch_sector_count) continue;
+
+        (void)diskio_watched_write_hook(watched, NULL, NULL);
+    }
+}
+
+/* whether the buffer is one 32-bit word repeated throughout, and if so, which. compared a word
+ at a time, as fatfs buffers are usually but not necessarily aligned, and each memcpy is a
+ single load either way on the cortex-m4 */
+static int buffer_is_fill(const BYTE * buff, UINT count, uint32_t * fill) {
+    uint32_t first;
+    __builtin_memcpy(&first, buff, 4);
+
+    for (size_t iword = 1; iword < 128 * count; iword++) {
+        uint32_t word;
+        __builtin_memcpy(&word, buff + 4 * iword, 4);
+        if (word != first) return 0;
+    }
+
+    *fill = first;
+    return 1;
+}
 
-    if (!deferred_zeros_sector_count || sector == deferred_zeros_sector_start + deferred_zeros_sector_count) {
-        if (buffer_points_to_all_zeros(buff, count)) {
-            if (!deferred_zeros_sector_count)
-                deferred_zeros_sector_start = sector;
-            deferred_zeros_sector_count += count;
+static DRESULT write_sectors(const BYTE * buff, LBA_t sector, UINT count) {
+    if (watch_sector_count && -1 == report_watched_writes(buff, sector, count)) return RES_ERROR;
+
+    /* whatever happens below, no cached copy of any of these sectors is current any more */
+    uncache_blocks(sector, count);
+
+#ifdef SPI_SD_HEATMAP
+    spi_sd_heatmap_logical_write(sector, count);
+#endif
+
+    if (!deferred_fill_sector_count || sector == deferred_fill_sector_start + deferred_fill_sector_count) {
+        uint32_t fill;
+        if (buffer_is_fill(buff, count, &fill) && (!deferred_fill_sector_count || fill == deferred_fill_word)) {
+            if (!deferred_fill_sector_count) {
+                deferred_fill_sector_start = sector;
+                deferred_fill_word = fill;
+            }
+            deferred_fill_sector_count += count;
+            TRACE_FLAG(DISKIO_TRACE_DEFERRED_FILL);
+            TRACE_ARG(fill);
+            spi_sd_stats.deferred_fill_sectors += count;
             return 0;
         }
     }
-    else if (deferred_zeros_sector_count) {
-        const DRESULT res = flush_deferred_zeros();
-        if (res) return res;
+    else if (deferred_fill_sector_count) {
+        const DRESULT res = flush_deferred_fill();
+        if (res) {
+            report_watched_failure(sector, count);
+            return res;
+        }
     }
 
     if (verbose >= 2)
@@ -148,15 +611,21 @@ DRESULT disk_write(BYTE pdrv, const BYTE * buff, LBA_t sector, UINT count) {
 
     for (size_t ipass = 0;; ipass++) {
         if (ipass > 0) {
+            TRACE_RETRY();
+            spi_sd_stats.retries[SPI_SD_OP_WRITE]++;
             if (verbose >= 1)
                 dprintf(2, "%s: retrying at lower baud rate %u\r\n", __func__, (unsigned)ipass + 1);
             if (-1 == spi_sd_init(ipass)) continue;
+            spi_sd_stats.baud_reductions[SPI_SD_OP_WRITE]++;
         }
 
         fatfs_sectors_written += count;
 
-        if (spi_sd_write_blocks(buff, count, sector) != -1) break;
-        if (ipass > 3) return RES_ERROR;
+        if (write_blocks(buff, 0, count, sector) != -1) break;
+        if (ipass > 3) {
+            report_watched_failure(sector, count);
+            return RES_ERROR;
+        }
 
     }
 
@@ -166,19 +635,74 @@ DRESULT disk_write(BYTE pdrv, const BYTE * buff, LBA_t sector, UINT count) {
     return 0;
 }
 
-DRESULT disk_ioctl(BYTE pdrv, BYTE cmd, void * buff) {
+DRESULT disk_write(BYTE pdrv, const BYTE * buff, LBA_t sector, UINT count) {
     (void)pdrv;
+    take_lock_for_write();
+
+    DRESULT res;
+    TRACED(res, DISKIO_TRACE_WRITE, sector, count, write_sectors(buff, sector, count));
+
+    coop_lock_give(&diskio_lock);
+    return res;
+}
+
+static DRESULT control(BYTE cmd, void * buff) {
     if (CTRL_SYNC == cmd) {
-        if (deferred_zeros_sector_count) {
-            const DRESULT res = flush_deferred_zeros();
+        if (deferred_fill_sector_count) {
+            const DRESULT res = flush_deferred_fill();
             if (res) return res;
         }
         return 0;
     }
-    else if (GET_BLOCK_SIZE == cmd)
-        *(LBA_t *)buff = 1; /* TODO: populate this from actual */
-    else if (GET_SECTOR_COUNT == cmd)
-        *(LBA_t *)buff = INT_MAX; /* TODO: populate this from actual */
+    else if (GET_BLOCK_SIZE == cmd) {
+        /* fatfs wants a power of two no larger than 32768, so use the largest such factor of
+         the allocation unit size, which may be e.g. 12 MiB */
+        const unsigned long au = spi_sd_au_blocks();
+        const unsigned long pow2 = au & -au;
+        *(DWORD *)buff = !au ? 1 : pow2 < 32768 ? pow2 : 32768;
+    }
+    else if (GET_SECTOR_COUNT == cmd) {
+        const unsigned long long blocks = spi_sd_card_blocks();
+        if (!blocks) return RES_ERROR;
+        *(LBA_t *)buff = blocks <= (LBA_t)-1 ? blocks : (LBA_t)-1;
+    }
+    else if (CTRL_TRIM == cmd) {
+        /* fatfs passes the first and last sectors of the range */
+        const LBA_t * range = buff;
+        if (range[1] < range[0]) return RES_PARERR;
+        TRACE_ARG(range[1]);
+
+        /* trim is only a hint, and cmd38 over part of an allocation unit may make the card copy
+         the rest of it elsewhere, taking as long as writing it. so only whole allocation units
+         within the range are erased, and the rest of it, or all of it if the allocation unit
+         size is not known, is ignored */
+        const unsigned long au = spi_sd_au_blocks();
+        if (!au) return 0;
+        const LBA_t start = (range[0] + au - 1) / au * au, end = (range[1] + 1) / au * au;
+        if (end <= start) return 0;
+
+        /* a deferred run overlapping the erased part would otherwise be written over it later */
+        if (deferred_fill_sector_count && deferred_fill_sector_start < end &&
+            deferred_fill_sector_start + deferred_fill_sector_count > start) {
+            const DRESULT res = flush_deferred_fill();
+            if (res) return res;
+        }
+
+        uncache_blocks(start, end - start);
+        return erase(start, end - start);
+    }
     else return RES_PARERR;
     return 0;
 }
+
+DRESULT disk_ioctl(BYTE pdrv, BYTE cmd, void * buff) {
+    (void)pdrv;
+    take_lock_for_write();
+
+    DRESULT res;
+    /* the first sector of a trim is recorded in place of the sector, and the last in arg */
+    TRACED(res, DISKIO_TRACE_IOCTL, CTRL_TRIM == cmd ? ((const LBA_t *)buff)[0] : 0, cmd, control(cmd, buff));
+
+    coop_lock_give(&diskio_lock);
+    return res;
+}
@@ -0,0 +1,66 @@
+/* optional functionality provided by diskio.c beyond what ff.c expects of it */
+#include "ff.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* if built with DISKIO_TRACE defined, every call into diskio.c from fatfs is logged into a
+ ring buffer of these, which the application can drain and write out somewhere. all fields
+ are little endian on disk, as they are in memory on the samd51 */
+struct diskio_trace_record {
+    uint32_t sector;
+    uint32_t duration; /* in units of diskio_trace_clock() */
+
+    /* for ioctl, this is the command instead. fatfs passes whole contiguous runs of clusters,
+     which can be more than 65535 sectors */
+    uint32_t count;
+
+    /* for a CTRL_TRIM ioctl, the last sector of the range, with sector holding the first. for a
+     write absorbed into a deferred run, the word repeated throughout it */
+    uint32_t arg;
+
+    uint8_t op;
+    uint8_t flags; /* low four bits are the number of retries, saturating at 15 */
+    uint16_t reserved;
+};
+
+enum { DISKIO_TRACE_READ = 1, DISKIO_TRACE_WRITE = 2, DISKIO_TRACE_IOCTL = 3 };
+
+#define DISKIO_TRACE_CACHE_HIT 0x10U
+#define DISKIO_TRACE_DEFERRED_FILL 0x20U /* write was absorbed into a deferred run of a repeated word */
+#define DISKIO_TRACE_FLUSHED_FILL 0x40U /* call caused a deferred run to be written */
+#define DISKIO_TRACE_ERROR 0x80U
+
+/* copies out and removes up to max of the oldest records, returns the number copied */
+size_t diskio_trace_drain(struct diskio_trace_record * out, size_t max);
+
+/* number of records overwritten before they could be drained */
+extern size_t diskio_trace_dropped;
+
+/* weak, returns zero unless the application provides something like micros() */
+uint32_t diskio_trace_clock(void);
+
+/* returns a pointer to a cached copy of the given sector, which is pinned in the cache until
+ released. on a miss the sector is read by dma directly into the cache entry. returns null on
+ error or if every entry in the cache is already pinned. do not write through the pointer, and
+ do not hold it across writes to the same sector, which will not be reflected in it */
+const void * disk_read_pinned(BYTE pdrv, LBA_t sector);
+void disk_release(BYTE pdrv, const void * view);
+
+/* writes by fatfs to sectors within the given range, which may be empty, are reported to the
+ hook below before they reach the cache or the card, along with what the sector held before if
+ that is known without reading the card, or null if not. if the hook returns -1, the write fails
+ without reaching the card. if a reported write then fails, each of its sectors is reported
+ again with both pointers null, as their contents are no longer known. the hook is weak, and is
+ called with this layer's lock held, so it may use samd51_sdcard.h directly but must not call
+ into fatfs or the disk_ functions */
+void diskio_watch(LBA_t sector, LBA_t count);
+int diskio_watched_write_hook(LBA_t sector, const void * before, const void * after);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,123 @@
+/* host-side tool which replays a trace captured by diskio.c built with DISKIO_TRACE against
+ the same diskio.c, backed by a disk image file, and reports what the card would have seen.
+ the allocation unit size and erased byte value of the card the trace was captured on, as
+ reported by spi_sd_au_blocks() and spi_sd_erase_fill(), should be given with -a and -e, as
+ they change what diskio.c sends the card. build e.g. with:
+ cc -O2 -DDISKIO_CACHE_BLOCKS=32 diskio_replay.c diskio.c sdcard_image.c */
+#include "ff.h"
+#include "diskio.h"
+
+#include "diskio_extras.h"
+#include "samd51_sdcard.h"
+#include "sdcard_image.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+extern size_t fatfs_sectors_read, fatfs_sectors_written;
+
+static void fill_nonuniform(unsigned char * buf, const uint32_t sector, const size_t count) {
+    /* content such that diskio.c will not consider it deferrable */
+    for (size_t ibyte = 0; ibyte < 512 * count; ibyte++)
+        buf[ibyte] = (unsigned char)(ibyte * 31U + sector + 1);
+}
+
+int main(const int argc, const char * const * const argv) {
+    int iarg = 1;
+    for (; iarg + 1 < argc && '-' == argv[iarg][0]; iarg += 2) {
+        if (!strcmp(argv[iarg], "-a")) sdcard_image_au_blocks = strtoul(argv[iarg + 1], NULL, 0);
+        else if (!strcmp(argv[iarg], "-e")) sdcard_image_erase_fill = strtoul(argv[iarg + 1], NULL, 0) ? 0xFF : 0;
+        else break;
+    }
+
+    if (argc - iarg != 2) {
+        fprintf(stderr, "usage: %s [-a au_blocks] [-e 0|0xff] trace.bin scratch_copy_of_disk.img\n", argv[0]);
+        return 1;
+    }
+
+    FILE * trace = fopen(argv[iarg], "rb");
+    if (!trace) {
+        perror(argv[iarg]);
+        return 1;
+    }
+
+    if (-1 == sdcard_image_open(argv[iarg + 1])) {
+        perror(argv[iarg + 1]);
+        return 1;
+    }
+
+    if (disk_initialize(0)) {
+        fprintf(stderr, "%s: disk_initialize failed\n", argv[0]);
+        return 1;
+    }
+
+    unsigned char * buf = NULL;
+    size_t buf_sectors = 0;
+
+    size_t records = 0, errors = 0, captured_hits = 0, captured_deferred = 0;
+    size_t sectors_requested_read = 0, sectors_requested_written = 0;
+    unsigned long long captured_duration = 0;
+
+    struct diskio_trace_record record;
+    while (fread(&record, sizeof(record), 1, trace) == 1) {
+        records++;
+        captured_duration += record.duration;
+        if (record.flags & DISKIO_TRACE_CACHE_HIT) captured_hits++;
+        if (record.flags & DISKIO_TRACE_DEFERRED_FILL) captured_deferred++;
+
+        if (DISKIO_TRACE_IOCTL != record.op && record.count > buf_sectors) {
+            buf_sectors = record.count;
+            buf = realloc(buf, 512 * buf_sectors);
+            if (!buf) abort();
+        }
+
+        DRESULT res;
+        if (DISKIO_TRACE_READ == record.op) {
+            sectors_requested_read += record.count;
+            res = disk_read(0, buf, record.sector, record.count);
+        }
+        else if (DISKIO_TRACE_WRITE == record.op) {
+            sectors_requested_written += record.count;
+            /* rebuilt from the recorded word, as whether the run is erased or written when it is
+             flushed depends on it */
+            if (record.flags & DISKIO_TRACE_DEFERRED_FILL)
+                for (size_t iword = 0; iword < 128 * record.count; iword++)
+                    __builtin_memcpy(buf + 4 * iword, &record.arg, 4);
+            else
+                fill_nonuniform(buf, record.sector, record.count);
+            res = disk_write(0, buf, record.sector, record.count);
+        }
+        else if (DISKIO_TRACE_IOCTL == record.op) {
+            /* also serves as the output of the ioctls which have one */
+            LBA_t range[2] = { record.sector, record.arg };
+            res = disk_ioctl(0, record.count, range);
+        }
+        else {
+            fprintf(stderr, "%s: bad op %u in record %zu\n", argv[0], record.op, records - 1);
+            return 1;
+        }
+
+        if (res) errors++;
+    }
+
+    /* flush anything still deferred, as fatfs would at f_sync */
+    disk_ioctl(0, CTRL_SYNC, NULL);
+
+    printf("records: %zu, replay errors: %zu, captured duration: %llu\n", records, errors, captured_duration);
+    printf("captured cache hits: %zu, captured deferred fill writes: %zu\n", captured_hits, captured_deferred);
+    printf("sectors requested by fatfs: %zu read, %zu written\n", sectors_requested_read, sectors_requested_written);
+    printf("sectors sent to card: %zu read in %zu commands, %zu written in %zu commands\n",
+           sdcard_image_blocks_read, sdcard_image_read_commands, sdcard_image_blocks_written, sdcard_image_write_commands);
+    printf("sectors erased on card: %zu in %zu commands\n", sdcard_image_blocks_erased, sdcard_image_erase_commands);
+    printf("sectors counted by diskio: %zu read, %zu written\n", fatfs_sectors_read, fatfs_sectors_written);
+    printf("cache hits: %lu, misses: %lu, evictions: %lu, deferred fill sectors: %lu\n",
+           spi_sd_stats.cache_hits, spi_sd_stats.cache_misses, spi_sd_stats.cache_evictions, spi_sd_stats.deferred_fill_sectors);
+    if (sectors_requested_read)
+        printf("read hit rate: %.3f\n", 1.0 - (double)sdcard_image_blocks_read / sectors_requested_read);
+
+    free(buf);
+    fclose(trace);
+    sdcard_image_close();
+    return 0;
+}
@@ -0,0 +1,239 @@
+/* builds and caches fatfs fast seek tables (FF_USE_FASTSEEK) for open files, so that seeking
+ within a large file costs no FAT reads. tables are carved out of one static pool, and a file
+ whose table does not fit simply goes without one until memory is freed up */
+#include "fastseek.h"
+
+#include <stddef.h>
+
+#if !FF_USE_FASTSEEK
+#error "FF_USE_FASTSEEK must be enabled in ffconf.h"
+#endif
+
+#ifndef FASTSEEK_POOL_WORDS
+#define FASTSEEK_POOL_WORDS 512
+#endif
+
+#ifndef FASTSEEK_FILES
+#define FASTSEEK_FILES 4
+#endif
+
+/* a file occupying a single fragment needs four words: size, length and start, terminator */
+#define FASTSEEK_MIN_WORDS 4
+
+static DWORD pool[FASTSEEK_POOL_WORDS];
+
+static struct fastseek_slot {
+    FIL * fp;
+    size_t offset, words;
+
+    /* size in bytes of the part of the file that the current table covers */
+    FSIZE_t mapped_size;
+
+    /* if stale is set, the cluster chain has changed and the table must be rebuilt. if only grown
+     is set, clusters have been added past the end of the table, which can be extended */
+    unsigned char stale, grown;
+
+    /* set if the table last failed to fit in the pool, when the file was failed_size bytes and
+     the pool had seen failed_frees frees. it is not tried again until one of those changes */
+    unsigned char failed;
+    unsigned long failed_frees;
+    FSIZE_t failed_size;
+} slots[FASTSEEK_FILES];
+
+/* number of times a table has been freed, so that failed slots know when to try again */
+static unsigned long pool_frees = 0;
+
+static FSIZE_t cluster_bytes(const FIL * fp) {
+    return (FSIZE_t)fp->obj.fs->csize * FF_MAX_SS;
+}
+
+static struct fastseek_slot * slot_for(const FIL * fp) {
+    for (size_t islot = 0; islot < FASTSEEK_FILES; islot++)
+        if (slots[islot].fp == fp) return slots + islot;
+    return NULL;
+}
+
+static int region_is_free(const size_t offset, const size_t words) {
+    if (offset + words > FASTSEEK_POOL_WORDS) return 0;
+
+    for (size_t islot = 0; islot < FASTSEEK_FILES; islot++) {
+        const struct fastseek_slot * other = slots + islot;
+        if (other->fp && other->words &&
+            offset < other->offset + other->words && other->offset < offset + words)
+            return 0;
+    }
+    return 1;
+}
+
+/* first fit, where the candidates are the start of the pool and the end of each region */
+static int allocate(struct fastseek_slot * slot, const size_t words) {
+    slot->words = 0;
+
+    if (region_is_free(0, words)) {
+        slot->offset = 0;
+        slot->words = words;
+        return 0;
+    }
+
+    for (size_t islot = 0; islot < FASTSEEK_FILES; islot++) {
+        const struct fastseek_slot * other = slots + islot;
+        if (!other->fp || !other->words) continue;
+
+        if (region_is_free(other->offset + other->words, words)) {
+            slot->offset = other->offset + other->words;
+            slot->words = words;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+static void build_failed(struct fastseek_slot * slot) {
+    slot->failed = 1;
+    slot->failed_frees = pool_frees;
+    slot->failed_size = f_size(slot->fp);
+}
+
+static int build(struct fastseek_slot * slot) {
+    FIL * fp = slot->fp;
+    fp->cltbl = NULL;
+    slot->stale = 1;
+    slot->grown = 0;
+
+    /* try with whatever the slot already has, or the minimum, then with what fatfs says it needs */
+    size_t words = slot->words > FASTSEEK_MIN_WORDS ? slot->words : FASTSEEK_MIN_WORDS;
+    for (size_t ipass = 0; ipass < 2; ipass++) {
+        if (-1 == allocate(slot, words)) {
+            build_failed(slot);
+            return -1;
+        }
+
+        fp->cltbl = pool + slot->offset;
+        fp->cltbl[0] = slot->words;
+
+        const FRESULT res = f_lseek(fp, CREATE_LINKMAP);
+        if (FR_OK == res) {
+            slot->mapped_size = (f_size(fp) + cluster_bytes(fp) - 1) / cluster_bytes(fp) * cluster_bytes(fp);
+            slot->stale = 0;
+            slot->failed = 0;
+            return 0;
+        }
+
+        /* on this error fatfs has stored the required table size in the first word */
+        words = fp->cltbl[0];
+        fp->cltbl = NULL;
+        slot->words = 0;
+        if (res != FR_NOT_ENOUGH_CORE) return -1;
+    }
+
+    build_failed(slot);
+    return -1;
+}
+
+/* appends the clusters added since the table was built or last extended, walking the FAT only
+ from the last cluster already mapped. returns -1 if the table has no room for another fragment
+ or the walk fails, in which case it is left covering what it did before */
+static int extend(struct fastseek_slot * slot) {
+    FIL * fp = slot->fp;
+    DWORD * table = pool + slot->offset;
+    const FSIZE_t bcs = cluster_bytes(fp);
+
+    /* find the terminator after the last pair of length and starting cluster */
+    size_t iword = 1;
+    while (table[iword]) iword += 2;
+    if (1 == iword) return -1;
+
+    /* use the table to land on the last mapped cluster, as fatfs leaves the position at the end
+     of a cluster rather than the start of the next */
+    fp->cltbl = table;
+    FRESULT res = f_lseek(fp, slot->mapped_size);
+    fp->cltbl = NULL;
+
+    /* then step forward one cluster at a time without it, which fatfs does from where it is */
+    for (FSIZE_t ofs = slot->mapped_size + 1; FR_OK == res && ofs <= f_size(fp); ofs += bcs) {
+        if ((res = f_lseek(fp, ofs)) != FR_OK) break;
+
+        if (fp->clust == table[iword - 1] + table[iword - 2])
+            table[iword - 2]++;
+        else if (iword + 2 < slot->words) {
+            table[iword] = 1;
+            table[iword + 1] = fp->clust;
+            table[iword + 2] = 0;
+            iword += 2;
+        }
+        else return -1;
+
+        slot->mapped_size = ofs - 1 + bcs;
+    }
+
+    if (res != FR_OK) return -1;
+
+    fp->cltbl = table;
+    slot->grown = 0;
+    return 0;
+}
+
+int fastseek_attach(FIL * fp) {
+    struct fastseek_slot * slot = slot_for(fp);
+    if (!slot) {
+        slot = slot_for(NULL);
+        if (!slot) return -1;
+        *slot = (struct fastseek_slot) { .fp = fp };
+    }
+
+    return build(slot);
+}
+
+void fastseek_detach(FIL * fp) {
+    struct fastseek_slot * slot = slot_for(fp);
+    if (!slot) return;
+
+    fp->cltbl = NULL;
+    if (slot->words) pool_frees++;
+    *slot = (struct fastseek_slot) { 0 };
+}
+
+void fastseek_invalidate(FIL * fp) {
+    struct fastseek_slot * slot = slot_for(fp);
+    if (!slot) return;
+
+    fp->cltbl = NULL;
+    slot->stale = 1;
+}
+
+FRESULT fastseek_lseek(FIL * fp, FSIZE_t ofs) {
+    struct fastseek_slot * slot = slot_for(fp);
+
+    /* fatfs clips seeks past the end of the file in fast seek mode, so seeking to expand the
+     file must be done without the table, after which the table is short of the end */
+    if (slot && ofs > f_size(fp)) {
+        if (fp->cltbl) slot->grown = 1;
+        fp->cltbl = NULL;
+        return f_lseek(fp, ofs);
+    }
+
+    /* a table which did not fit is not tried again, at the cost of a walk of the whole chain,
+     until another table has been freed or the file has grown by at least a cluster since */
+    if (slot && (slot->stale || slot->grown) && (!slot->failed || slot->failed_frees != pool_frees ||
+                                                 f_size(fp) >= slot->failed_size + cluster_bytes(fp))) {
+        /* if the table could not be extended or rebuilt, the seek proceeds by walking the FAT */
+        if (slot->stale || -1 == extend(slot))
+            (void)build(slot);
+    }
+
+    return f_lseek(fp, ofs);
+}
+
+FRESULT fastseek_write(FIL * fp, const void * buf, UINT btw, UINT * bw) {
+    struct fastseek_slot * slot = slot_for(fp);
+
+    /* fatfs cannot follow a table past its end, so set it aside if this write may need new
+     clusters, to be extended by the next seek */
+    if (slot && fp->cltbl && f_tell(fp) + btw > slot->mapped_size) {
+        fp->cltbl = NULL;
+        slot->grown = 1;
+    }
+
+    return f_write(fp, buf, btw, bw);
+}
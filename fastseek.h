@@ -0,0 +1,24 @@
+/* management of fatfs fast seek cluster link map tables from a fixed memory budget */
+#include "ff.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* builds a table for an open file, returns -1 if it could not (file remains usable without) */
+int fastseek_attach(FIL * fp);
+
+/* must be called prior to f_close on a file that was attached */
+void fastseek_detach(FIL * fp);
+
+/* must be called after anything other than fastseek_write changes the cluster chain */
+void fastseek_invalidate(FIL * fp);
+
+/* use these instead of f_lseek and f_write on attached files. the table is extended lazily on
+ seek if the file has grown, and the file falls back to walking the FAT if it cannot be */
+FRESULT fastseek_lseek(FIL * fp, FSIZE_t ofs);
+FRESULT fastseek_write(FIL * fp, const void * buf, UINT btw, UINT * bw);
+
+#ifdef __cplusplus
+}
+#endif
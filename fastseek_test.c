@@ -0,0 +1,246 @@
+/* host-side test of the fast seek table allocator, against a stand-in for the parts of fatfs it
+ relies on, which follows the same rules as fatfs for f_lseek and f_write with and without a
+ cluster link map table, and counts FAT reads and table builds. exits nonzero on failure.
+ build e.g. with:
+ cc -O2 -Ipath/to/fatfs/source -DFASTSEEK_POOL_WORDS=32 fastseek_test.c fastseek.c -o fastseek_test */
+#include "fastseek.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#if FASTSEEK_POOL_WORDS != 32
+#error "build with -DFASTSEEK_POOL_WORDS=32"
+#endif
+
+static size_t failures = 0;
+
+#define CHECK(cond) do { if (!(cond)) { fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); failures++; } } while(0)
+
+#define CLUSTERS 1024
+#define END_OF_CHAIN 0xFFFFFFFFU
+
+/* one sector per cluster, and a FAT in which each entry is the next cluster of its chain */
+static FATFS fs = { .csize = 1, .n_fatent = CLUSTERS };
+static DWORD fat[CLUSTERS];
+static DWORD next_free = 2;
+
+static size_t fat_reads = 0, linkmap_builds = 0;
+
+static DWORD get_fat(const DWORD clst) {
+    fat_reads++;
+    return fat[clst];
+}
+
+/* clusters are handed out in order, so files growing alternately end up fragmented */
+static DWORD create_chain(const DWORD clst) {
+    if (clst) {
+        const DWORD next = get_fat(clst);
+        if (next != END_OF_CHAIN) return next;
+    }
+    if (next_free >= CLUSTERS) return 0;
+
+    const DWORD added = next_free++;
+    fat[added] = END_OF_CHAIN;
+    if (clst) fat[clst] = added;
+    return added;
+}
+
+static DWORD clmt_clust(const FIL * fp, const FSIZE_t ofs) {
+    const DWORD * tbl = fp->cltbl + 1;
+    DWORD cl = ofs / FF_MAX_SS / fs.csize;
+    for (;;) {
+        const DWORD ncl = *tbl++;
+        if (!ncl) return 0;
+        if (cl < ncl) break;
+        cl -= ncl;
+        tbl++;
+    }
+    return cl + *tbl;
+}
+
+FRESULT f_lseek(FIL * fp, FSIZE_t ofs) {
+    const FSIZE_t bcs = (FSIZE_t)fs.csize * FF_MAX_SS;
+
+    if (fp->cltbl) {
+        if (CREATE_LINKMAP == ofs) {
+            linkmap_builds++;
+            DWORD * tbl = fp->cltbl;
+            const DWORD tlen = *tbl++;
+            DWORD ulen = 2, cl = fp->obj.sclust;
+            if (cl) do {
+                const DWORD tcl = cl;
+                DWORD ncl = 0, pcl;
+                ulen += 2;
+                do {
+                    pcl = cl;
+                    ncl++;
+                    cl = get_fat(cl);
+                } while (cl == pcl + 1);
+                if (ulen <= tlen) {
+                    *tbl++ = ncl;
+                    *tbl++ = tcl;
+                }
+            } while (cl != END_OF_CHAIN);
+            *fp->cltbl = ulen;
+            if (ulen > tlen) return FR_NOT_ENOUGH_CORE;
+            *tbl = 0;
+            return FR_OK;
+        }
+
+        if (ofs > f_size(fp)) ofs = f_size(fp);
+        fp->fptr = ofs;
+        if (ofs) fp->clust = clmt_clust(fp, ofs - 1);
+        return FR_OK;
+    }
+
+    /* without a table, walk forward from the current cluster if possible, and stretch the
+     file if seeking past its end, as fatfs does for files open for writing */
+    const FSIZE_t ifptr = fp->fptr;
+    fp->fptr = 0;
+    if (ofs) {
+        DWORD clst;
+        if (ifptr && (ofs - 1) / bcs >= (ifptr - 1) / bcs) {
+            fp->fptr = (ifptr - 1) & ~(bcs - 1);
+            ofs -= fp->fptr;
+            clst = fp->clust;
+        } else {
+            clst = fp->obj.sclust;
+            if (!clst) clst = fp->obj.sclust = create_chain(0);
+            fp->clust = clst;
+        }
+
+        while (ofs > bcs) {
+            ofs -= bcs;
+            fp->fptr += bcs;
+            clst = create_chain(clst);
+            if (!clst) return FR_DENIED;
+            fp->clust = clst;
+        }
+        fp->fptr += ofs;
+    }
+    if (fp->fptr > f_size(fp)) fp->obj.objsize = fp->fptr;
+    return FR_OK;
+}
+
+FRESULT f_write(FIL * fp, const void * buff, UINT btw, UINT * bw) {
+    (void)buff;
+    const FSIZE_t bcs = (FSIZE_t)fs.csize * FF_MAX_SS;
+
+    *bw = 0;
+    while (btw) {
+        if (!(fp->fptr % bcs)) {
+            DWORD clst;
+            if (!fp->fptr) clst = fp->obj.sclust ? fp->obj.sclust : (fp->obj.sclust = create_chain(0));
+            else if (fp->cltbl) clst = clmt_clust(fp, fp->fptr);
+            else clst = create_chain(fp->clust);
+
+            /* fatfs stops short when the table does not cover the next cluster */
+            if (!clst) break;
+            fp->clust = clst;
+        }
+
+        const UINT now = bcs - fp->fptr % bcs < btw ? bcs - fp->fptr % bcs : btw;
+        fp->fptr += now;
+        *bw += now;
+        btw -= now;
+        if (fp->fptr > f_size(fp)) fp->obj.objsize = fp->fptr;
+    }
+    return FR_OK;
+}
+
+static void open_file(FIL * fp) {
+    memset(fp, 0, sizeof(*fp));
+    fp->obj.fs = &fs;
+}
+
+/* grows the file by up to four clusters in one write */
+static void append_clusters(FIL * fp, const size_t clusters) {
+    static const unsigned char zeros[4 * FF_MAX_SS];
+    UINT bw;
+    CHECK(FR_OK == fastseek_lseek(fp, f_size(fp)));
+    CHECK(FR_OK == fastseek_write(fp, zeros, clusters * FF_MAX_SS, &bw) && clusters * FF_MAX_SS == bw);
+}
+
+/* the cluster holding the given byte, found without going through the stand-in */
+static DWORD cluster_of(const FIL * fp, const FSIZE_t ofs) {
+    DWORD clst = fp->obj.sclust;
+    for (FSIZE_t icluster = 0; icluster < ofs / FF_MAX_SS; icluster++)
+        clst = fat[clst];
+    return clst;
+}
+
+/* seeks into the middle of every cluster of the file, returns the number of FAT reads taken */
+static size_t check_seeks(FIL * fp) {
+    const size_t reads_before = fat_reads;
+    for (FSIZE_t ofs = FF_MAX_SS / 2; ofs < f_size(fp); ofs += FF_MAX_SS) {
+        CHECK(FR_OK == fastseek_lseek(fp, ofs));
+        CHECK(fp->fptr == ofs && fp->clust == cluster_of(fp, ofs));
+    }
+    return fat_reads - reads_before;
+}
+
+int main(void) {
+    FIL a, b, c;
+    open_file(&a);
+    open_file(&b);
+    open_file(&c);
+
+    /* a and b grow alternately, then a grows by itself, so a has four fragments */
+    for (size_t ipass = 0; ipass < 3; ipass++) {
+        append_clusters(&a, 1);
+        append_clusters(&b, 1);
+    }
+    append_clusters(&a, 4);
+
+    /* a table of ten words fits, after which seeking anywhere reads nothing from the FAT */
+    CHECK(0 == fastseek_attach(&a));
+    CHECK(a.cltbl && 10 == a.cltbl[0]);
+    CHECK(0 == check_seeks(&a));
+
+    /* contiguous growth extends the table in place, reading only the new part of the chain */
+    size_t builds_before = linkmap_builds;
+    append_clusters(&a, 2);
+    const size_t reads_before = fat_reads;
+    CHECK(FR_OK == fastseek_lseek(&a, 0));
+    CHECK(2 == fat_reads - reads_before);
+    CHECK(linkmap_builds == builds_before && a.cltbl);
+    CHECK(0 == check_seeks(&a));
+
+    /* growth into a new fragment which the table has no room for rebuilds it */
+    append_clusters(&b, 1);
+    append_clusters(&a, 1);
+    check_seeks(&a);
+    CHECK(linkmap_builds > builds_before && a.cltbl);
+    CHECK(0 == check_seeks(&a));
+
+    /* c alternates with b for eleven fragments, which need 24 words, more than remain */
+    for (size_t ipass = 0; ipass < 11; ipass++) {
+        append_clusters(&c, 1);
+        append_clusters(&b, 1);
+    }
+    CHECK(-1 == fastseek_attach(&c));
+    CHECK(!c.cltbl);
+
+    /* which is not tried again on every seek, but seeks still land in the right place */
+    builds_before = linkmap_builds;
+    CHECK(check_seeks(&c) > 0);
+    CHECK(linkmap_builds == builds_before);
+
+    /* nor after growth of less than a cluster */
+    UINT bw;
+    CHECK(FR_OK == fastseek_lseek(&c, f_size(&c)));
+    CHECK(FR_OK == fastseek_write(&c, "x", 1, &bw) && 1 == bw);
+    check_seeks(&c);
+    CHECK(linkmap_builds == builds_before);
+
+    /* but is once the pool has room again */
+    fastseek_detach(&a);
+    check_seeks(&c);
+    CHECK(linkmap_builds > builds_before && c.cltbl);
+    CHECK(0 == check_seeks(&c));
+
+    fastseek_detach(&c);
+
+    if (failures) fprintf(stderr, "%zu failures\n", failures);
+    return failures ? 1 : 0;
+}
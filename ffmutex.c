@@ -0,0 +1,65 @@
+/* synchronization handlers required by fatfs when FF_FS_REENTRANT is enabled. if FreeRTOS is
+ available its mutexes are used, otherwise waiting is done cooperatively via yield() */
+#include "ff.h"
+
+#if FF_FS_REENTRANT
+
+#if __has_include(<FreeRTOS.h>) && !defined(FF_MUTEX_NO_RTOS)
+#include <FreeRTOS.h>
+#include <semphr.h>
+
+/* one per volume plus one for the system-wide lock used when FF_FS_LOCK is enabled */
+static SemaphoreHandle_t mutexes[FF_VOLUMES + 1];
+
+int ff_mutex_create(int vol) {
+    mutexes[vol] = xSemaphoreCreateMutex();
+    return mutexes[vol] != NULL;
+}
+
+void ff_mutex_delete(int vol) {
+    vSemaphoreDelete(mutexes[vol]);
+    mutexes[vol] = NULL;
+}
+
+int ff_mutex_take(int vol) {
+    return xSemaphoreTake(mutexes[vol], FF_FS_TIMEOUT) == pdTRUE;
+}
+
+void ff_mutex_give(int vol) {
+    xSemaphoreGive(mutexes[vol]);
+}
+
+#else
+#include "coop_lock.h"
+
+static struct coop_lock mutexes[FF_VOLUMES + 1];
+
+/* application may provide a free-running clock, e.g. millis(), for FF_FS_TIMEOUT to count */
+__attribute((weak)) unsigned long ff_mutex_clock(void) { return 0; }
+
+int ff_mutex_create(int vol) {
+    coop_lock_give(mutexes + vol);
+    return 1;
+}
+
+void ff_mutex_delete(int vol) {
+    (void)vol;
+}
+
+int ff_mutex_take(int vol) {
+    const unsigned long start = ff_mutex_clock();
+
+    while (!coop_lock_try(mutexes + vol)) {
+        if (ff_mutex_clock() - start >= FF_FS_TIMEOUT) return 0;
+        yield();
+    }
+
+    return 1;
+}
+
+void ff_mutex_give(int vol) {
+    coop_lock_give(mutexes + vol);
+}
+
+#endif
+#endif
@@ -0,0 +1,398 @@
+/* the summary is the number of free clusters within each region of the allocation bitmap. while
+ mounted, it is updated from the old and new contents of each bitmap sector written by fatfs, as
+ reported by diskio.c, or the region is marked unknown and recounted at the next checkpoint if
+ the old contents were not cached. the checkpoint is a single block, read and written directly
+ rather than through fatfs or the block cache. it is marked clean when written, and marked dirty
+ on the card again just before the next change to the bitmap reaches it, so a checkpoint found
+ clean at mount matches the bitmap unless something else has written to the volume since. the
+ bitmap sectors where another host would most likely allocate, at the first free cluster, and
+ where this one would, at the allocation hint, are fingerprinted to catch most such cases */
+#include "freespace.h"
+
+#include "diskio.h"
+#include "diskio_extras.h"
+#include "samd51_sdcard.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#if !FF_FS_EXFAT
+#error "FF_FS_EXFAT must be enabled in ffconf.h"
+#endif
+
+/* sectors read at once when counting, from a static buffer */
+#ifndef FREESPACE_SCAN_SECTORS
+#define FREESPACE_SCAN_SECTORS 4
+#endif
+
+/* "FSPC" */
+#define FREESPACE_MAGIC 0x43505346
+
+/* a region whose count of free clusters is not known */
+#define UNKNOWN 0xFFFFFFFFU
+
+/* clusters per bitmap sector */
+#define SECTOR_CLUSTERS 4096U
+
+union checkpoint {
+    struct {
+        uint32_t magic;
+
+        /* serial number and geometry of the volume this describes */
+        uint32_t serial, n_fatent, bitbase;
+
+        uint32_t clean;
+        uint32_t free_clst, last_clst;
+
+        /* bitmap sectors, relative to the start of the bitmap, and their crcs */
+        uint32_t sample_sectors[2];
+        uint16_t sample_crcs[2];
+
+        uint32_t region_free[FREESPACE_REGIONS];
+    };
+
+    /* the last two bytes are a crc of the rest, stored such that the crc of all 512 is zero */
+    uint32_t words[128];
+    unsigned char bytes[512];
+};
+
+static_assert(40 + 4 * FREESPACE_REGIONS <= 510, "FREESPACE_REGIONS too large");
+
+/* volume being tracked, or null */
+static FATFS * volume = NULL;
+
+static LBA_t checkpoint_block;
+static uint32_t serial;
+static DWORD bitmap_sectors, sectors_per_region;
+static DWORD region_free[FREESPACE_REGIONS];
+
+/* set while the checkpoint on the card is marked clean */
+static unsigned char clean_on_card = 0;
+
+static union checkpoint checkpoint;
+static uint32_t scan_buffer[FREESPACE_SCAN_SECTORS][128];
+static FIL file;
+
+/* the same crc16 that the card uses for data blocks */
+static uint16_t crc16(const unsigned char * restrict const message, const size_t length) {
+    uint16_t crc = 0;
+
+    for (size_t ibyte = 0; ibyte < length; ibyte++) {
+        crc ^= message[ibyte] << 8U;
+
+        for (size_t ibit = 0; ibit < 8; ibit++)
+            crc = (crc & 0x8000u) ? (crc << 1) ^ 0x1021 : (crc << 1);
+    }
+
+    return crc;
+}
+
+/* clusters covered by the given bitmap sector, fewer than SECTOR_CLUSTERS in the last one */
+static DWORD sector_clusters(const DWORD isector) {
+    const DWORD clusters = volume->n_fatent - 2, first = isector * SECTOR_CLUSTERS;
+    return clusters - first < SECTOR_CLUSTERS ? clusters - first : SECTOR_CLUSTERS;
+}
+
+/* bit n of the bitmap is set if cluster n + 2 is in use */
+static DWORD sector_free(const void * sector, const DWORD isector) {
+    const uint32_t * words = sector;
+    const DWORD clusters = sector_clusters(isector);
+
+    DWORD used = 0;
+    for (size_t iword = 0; iword < clusters / 32; iword++)
+        used += __builtin_popcount(words[iword]);
+    if (clusters % 32)
+        used += __builtin_popcount(words[clusters / 32] & ((1UL << (clusters % 32)) - 1));
+
+    return clusters - used;
+}
+
+static DWORD region_end(const size_t iregion) {
+    const DWORD end = (iregion + 1) * sectors_per_region;
+    return end < bitmap_sectors ? end : bitmap_sectors;
+}
+
+/* calls the given function for each bitmap sector of the region, read several at a time, until
+ it returns nonzero, which is then returned, or -1 on a read error */
+static int for_each_sector(const size_t iregion, int (* func)(const void *, DWORD, void *), void * arg) {
+    const DWORD end = region_end(iregion);
+
+    for (DWORD isector = iregion * sectors_per_region; isector < end; isector += FREESPACE_SCAN_SECTORS) {
+        const UINT count = end - isector < FREESPACE_SCAN_SECTORS ? end - isector : FREESPACE_SCAN_SECTORS;
+        if (disk_read(volume->pdrv, (BYTE *)scan_buffer, volume->bitbase + isector, count) != RES_OK)
+            return -1;
+
+        for (UINT iscan = 0; iscan < count; iscan++) {
+            const int ret = func(scan_buffer[iscan], isector + iscan, arg);
+            if (ret) return ret;
+        }
+    }
+
+    return 0;
+}
+
+static int add_sector_free(const void * sector, const DWORD isector, void * arg) {
+    *(DWORD *)arg += sector_free(sector, isector);
+    return 0;
+}
+
+static int count_unknown_regions(void) {
+    for (size_t iregion = 0; iregion < FREESPACE_REGIONS; iregion++) {
+        if (region_free[iregion] != UNKNOWN) continue;
+
+        DWORD free = 0;
+        if (-1 == for_each_sector(iregion, add_sector_free, &free)) return -1;
+        region_free[iregion] = free;
+    }
+    return 0;
+}
+
+static DWORD total_free(void) {
+    DWORD total = 0;
+    for (size_t iregion = 0; iregion < FREESPACE_REGIONS; iregion++)
+        total += region_free[iregion];
+    return total;
+}
+
+static int find_free_in_sector(const void * sector, const DWORD isector, void * arg) {
+    const uint32_t * words = sector;
+    const DWORD clusters = sector_clusters(isector);
+
+    for (DWORD ibit = 0; ibit < clusters; ibit++) {
+        if (!(ibit % 32) && 0xFFFFFFFF == words[ibit / 32]) {
+            ibit += 31;
+            continue;
+        }
+
+        if (!(words[ibit / 32] >> (ibit % 32) & 1)) {
+            *(DWORD *)arg = isector * SECTOR_CLUSTERS + ibit + 2;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* lowest numbered free cluster, or zero if there are none, or -1 on a read error */
+static int first_free_cluster(DWORD * cluster) {
+    *cluster = 0;
+
+    for (size_t iregion = 0; iregion < FREESPACE_REGIONS; iregion++) {
+        if (!region_free[iregion]) continue;
+
+        const int ret = for_each_sector(iregion, find_free_in_sector, cluster);
+        if (ret) return 1 == ret ? 0 : -1;
+    }
+    return 0;
+}
+
+static int sector_crc(const DWORD isector, uint16_t * crc) {
+    if (disk_read(volume->pdrv, (BYTE *)scan_buffer, volume->bitbase + isector, 1) != RES_OK)
+        return -1;
+
+    *crc = crc16((const unsigned char *)scan_buffer, 512);
+    return 0;
+}
+
+static int write_checkpoint(void) {
+    const uint16_t crc = crc16(checkpoint.bytes, 510);
+    checkpoint.bytes[510] = crc >> 8;
+    checkpoint.bytes[511] = crc & 0xFF;
+
+    return spi_sd_write_blocks(checkpoint.words, 1, checkpoint_block);
+}
+
+static int checkpoint_is_valid(void) {
+    if (crc16(checkpoint.bytes, 512) || checkpoint.magic != FREESPACE_MAGIC || !checkpoint.clean ||
+        checkpoint.serial != serial || checkpoint.n_fatent != volume->n_fatent ||
+        checkpoint.bitbase != volume->bitbase || checkpoint.free_clst > volume->n_fatent - 2)
+        return 0;
+
+    DWORD total = 0;
+    for (size_t iregion = 0; iregion < FREESPACE_REGIONS; iregion++) {
+        if (UNKNOWN == checkpoint.region_free[iregion]) return 0;
+        total += checkpoint.region_free[iregion];
+    }
+    if (total != checkpoint.free_clst) return 0;
+
+    for (size_t isample = 0; isample < 2; isample++) {
+        uint16_t crc;
+        if (checkpoint.sample_sectors[isample] >= bitmap_sectors ||
+            -1 == sector_crc(checkpoint.sample_sectors[isample], &crc) ||
+            crc != checkpoint.sample_crcs[isample])
+            return 0;
+    }
+
+    return 1;
+}
+
+/* the reserved file occupies one cluster, of which the checkpoint is the first block */
+static int open_reserved_file(const TCHAR * path) {
+    if (f_open(&file, path, FA_READ | FA_WRITE | FA_OPEN_ALWAYS) != FR_OK) return -1;
+
+    FRESULT res = FR_OK;
+    if (!f_size(&file)) res = f_expand(&file, 512, 1);
+
+    if (FR_OK == res && file.obj.sclust >= 2)
+        checkpoint_block = volume->database + (LBA_t)volume->csize * (file.obj.sclust - 2);
+    else if (FR_OK == res)
+        res = FR_INT_ERR;
+
+    if (f_close(&file) != FR_OK) return -1;
+    return FR_OK == res ? 0 : -1;
+}
+
+int diskio_watched_write_hook(LBA_t sector, const void * before, const void * after) {
+    if (!volume) return 0;
+
+    /* the checkpoint on the card must stop claiming to be current before the bitmap changes, so
+     if it cannot be marked dirty, the bitmap is not changed either, and the next write tries again */
+    if (clean_on_card) {
+        checkpoint.clean = 0;
+        if (-1 == write_checkpoint()) {
+            dprintf(2, "%s: could not mark checkpoint dirty\r\n", __func__);
+            checkpoint.clean = 1;
+            return -1;
+        }
+        clean_on_card = 0;
+    }
+
+    const DWORD isector = sector - volume->bitbase;
+    const size_t iregion = isector / sectors_per_region;
+    if (UNKNOWN == region_free[iregion]) return 0;
+
+    /* also the case when a write reported earlier has failed */
+    if (!before || !after) region_free[iregion] = UNKNOWN;
+    else region_free[iregion] += sector_free(after, isector) - sector_free(before, isector);
+    return 0;
+}
+
+static void stop_tracking(void) {
+    diskio_watch(0, 0);
+    volume = NULL;
+    clean_on_card = 0;
+}
+
+int freespace_mount(FATFS * fs, const TCHAR * path) {
+    /* after a lazy f_mount(), the volume is only mounted by the first access to it. whether the
+     reserved file exists yet does not matter here */
+    (void)f_stat(path, NULL);
+    if (fs->fs_type != FS_EXFAT) return -1;
+
+    volume = fs;
+    clean_on_card = 0;
+    bitmap_sectors = (fs->n_fatent - 2 + SECTOR_CLUSTERS - 1) / SECTOR_CLUSTERS;
+    sectors_per_region = (bitmap_sectors + FREESPACE_REGIONS - 1) / FREESPACE_REGIONS;
+    for (size_t iregion = 0; iregion < FREESPACE_REGIONS; iregion++)
+        region_free[iregion] = UNKNOWN;
+
+    /* watch from here on, so that creating the reserved file is not missed */
+    diskio_watch(fs->bitbase, bitmap_sectors);
+
+    /* VolumeSerialNumber, from the boot sector */
+    if (disk_read(fs->pdrv, (BYTE *)scan_buffer, fs->volbase, 1) != RES_OK) {
+        stop_tracking();
+        return -1;
+    }
+    __builtin_memcpy(&serial, (unsigned char *)scan_buffer + 100, 4);
+
+    if (-1 == open_reserved_file(path)) {
+        stop_tracking();
+        return -1;
+    }
+
+    if (-1 != spi_sd_read_blocks(checkpoint.words, 1, checkpoint_block) && checkpoint_is_valid()) {
+        for (size_t iregion = 0; iregion < FREESPACE_REGIONS; iregion++)
+            region_free[iregion] = checkpoint.region_free[iregion];
+
+        fs->free_clst = checkpoint.free_clst;
+        fs->last_clst = checkpoint.last_clst;
+        clean_on_card = 1;
+        return 0;
+    }
+
+    /* no usable checkpoint, so count from scratch, which is still far faster than fatfs would,
+     as it reads the bitmap several sectors per command rather than one */
+    dprintf(2, "%s: no valid checkpoint, scanning bitmap\r\n", __func__);
+
+    for (size_t iregion = 0; iregion < FREESPACE_REGIONS; iregion++)
+        region_free[iregion] = UNKNOWN;
+
+    DWORD first_free;
+    if (-1 == count_unknown_regions() || -1 == first_free_cluster(&first_free)) {
+        stop_tracking();
+        return -1;
+    }
+
+    fs->free_clst = total_free();
+    if (first_free) fs->last_clst = first_free - 1;
+    return 0;
+}
+
+int freespace_checkpoint(void) {
+    FATFS * fs = volume;
+
+    /* a bitmap sector modified in the window but not yet written would be missed */
+    if (!fs || fs->wflag) return -1;
+
+    if (-1 == count_unknown_regions()) return -1;
+
+    if (fs->free_clst <= fs->n_fatent - 2 && fs->free_clst != total_free()) {
+        dprintf(2, "%s: summary disagrees with fatfs, recounting\r\n", __func__);
+        for (size_t iregion = 0; iregion < FREESPACE_REGIONS; iregion++)
+            region_free[iregion] = UNKNOWN;
+        if (-1 == count_unknown_regions()) return -1;
+    }
+    fs->free_clst = total_free();
+
+    DWORD first_free;
+    if (-1 == first_free_cluster(&first_free)) return -1;
+
+    const DWORD hint = fs->last_clst >= 2 && fs->last_clst < fs->n_fatent ? fs->last_clst :
+                       first_free ? first_free - 1 : 1;
+
+    checkpoint = (union checkpoint) { {
+        .magic = FREESPACE_MAGIC,
+        .serial = serial,
+        .n_fatent = fs->n_fatent,
+        .bitbase = fs->bitbase,
+        .clean = 1,
+        .free_clst = fs->free_clst,
+        .last_clst = hint,
+        .sample_sectors = {
+            first_free ? (first_free - 2) / SECTOR_CLUSTERS : 0,
+            hint >= 2 ? (hint - 2) / SECTOR_CLUSTERS : 0
+        }
+    } };
+
+    for (size_t iregion = 0; iregion < FREESPACE_REGIONS; iregion++)
+        checkpoint.region_free[iregion] = region_free[iregion];
+
+    for (size_t isample = 0; isample < 2; isample++)
+        if (-1 == sector_crc(checkpoint.sample_sectors[isample], checkpoint.sample_crcs + isample))
+            return -1;
+
+    if (-1 == write_checkpoint()) return -1;
+    clean_on_card = 1;
+    return 0;
+}
+
+int freespace_unmount(void) {
+    const int ret = freespace_checkpoint();
+    stop_tracking();
+    return ret;
+}
+
+int freespace_seek_free(DWORD clusters) {
+    if (!volume) return -1;
+
+    for (size_t iregion = 0; iregion < FREESPACE_REGIONS; iregion++) {
+        if (UNKNOWN == region_free[iregion] || region_free[iregion] < clusters) continue;
+
+        /* the hint is the last cluster allocated, so point it just before the region */
+        volume->last_clst = iregion * sectors_per_region * SECTOR_CLUSTERS + 2 - 1;
+        return 0;
+    }
+
+    return -1;
+}
@@ -0,0 +1,36 @@
+/* free space summary for exfat volumes, kept up to date as the allocation bitmap is written and
+ checkpointed to a reserved file, so that neither f_getfree() nor the first allocation after
+ mount has to scan the whole bitmap */
+#include "ff.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* the bitmap is summarized as this many regions of whole bitmap sectors */
+#ifndef FREESPACE_REGIONS
+#define FREESPACE_REGIONS 64
+#endif
+
+/* call right after f_mount() on an exfat volume. after a lazy f_mount(), the volume is mounted
+ here by looking up the given path. opens or creates the reserved file at that path, and seeds
+ the free cluster count and allocation hint of the volume from its checkpoint, or from a scan of
+ the bitmap using multi-block reads if the checkpoint is missing or stale. returns -1 and leaves
+ fatfs to its own devices if the volume is not exfat */
+int freespace_mount(FATFS * fs, const TCHAR * path);
+
+/* writes the summary to the reserved file as a checkpoint that the next mount will trust. call
+ once nothing is writing to the volume, after f_sync() or f_close() of every file written.
+ returns -1 if fatfs still has a bitmap change pending */
+int freespace_checkpoint(void);
+
+/* as above, then stops tracking. call before f_unmount() */
+int freespace_unmount(void);
+
+/* points the volume's allocation hint at the first region with at least the given number of free
+ clusters, so that the next f_expand() or allocation starts looking there. returns -1 if none */
+int freespace_seek_free(DWORD clusters);
+
+#ifdef __cplusplus
+}
+#endif
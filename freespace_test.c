@@ -0,0 +1,169 @@
+/* host-side test of the exfat free space summary against a scratch image holding just enough of
+ a volume for it: the boot sector, an allocation bitmap, and the reserved file, which stand-ins
+ for the few fatfs calls it makes locate. bitmap sectors are changed through diskio.c as fatfs
+ would change them. exits nonzero on failure. build e.g. with:
+ cc -O2 -Ipath/to/fatfs/source freespace_test.c freespace.c diskio.c sdcard_image.c -o freespace_test */
+#include "freespace.h"
+#include "diskio.h"
+#include "samd51_sdcard.h"
+#include "sdcard_image.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static size_t failures = 0;
+
+#define CHECK(cond) do { if (!(cond)) { fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); failures++; } } while(0)
+
+/* 300000 clusters, so 74 bitmap sectors, of which the first 5000 clusters are in use */
+#define CLUSTERS 300000
+#define USED_CLUSTERS 5000
+#define BITMAP_SECTORS ((CLUSTERS + 4095) / 4096)
+
+static FATFS fs;
+
+static void reset_volume(void) {
+    fs = (FATFS) {
+        .fs_type = FS_EXFAT, .n_fatent = 2 + CLUSTERS,
+        .volbase = 3000, .bitbase = 3100, .database = 4000, .csize = 8,
+        .free_clst = 0xFFFFFFFF, .last_clst = 0xFFFFFFFF
+    };
+}
+
+/* the reserved file already exists as a single cluster */
+FRESULT f_open(FIL * fp, const TCHAR * path, BYTE mode) {
+    (void)path;
+    (void)mode;
+    memset(fp, 0, sizeof(*fp));
+    fp->obj.fs = &fs;
+    fp->obj.objsize = 512;
+    fp->obj.sclust = 5;
+    return FR_OK;
+}
+
+FRESULT f_expand(FIL * fp, FSIZE_t size, BYTE opt) { (void)fp; (void)size; (void)opt; return FR_OK; }
+FRESULT f_close(FIL * fp) { (void)fp; return FR_OK; }
+FRESULT f_stat(const TCHAR * path, FILINFO * fno) { (void)path; (void)fno; return FR_OK; }
+
+/* as fatfs does it, through the block cache, one bitmap sector at a time */
+static DRESULT set_cluster_used(const DWORD cluster, const int used) {
+    unsigned char sector[512];
+    const LBA_t lba = fs.bitbase + (cluster - 2) / 4096;
+    const DWORD ibit = (cluster - 2) % 4096;
+
+    if (disk_read(0, sector, lba, 1) != RES_OK) return RES_ERROR;
+    if (used) sector[ibit / 8] |= 1U << ibit % 8;
+    else sector[ibit / 8] &= ~(1U << ibit % 8);
+    return disk_write(0, sector, lba, 1);
+}
+
+/* free clusters according to the bitmap, read through diskio.c, as a sector of all ones may
+ still be deferred rather than on the card */
+static DWORD count_free(void) {
+    static unsigned char bitmap[BITMAP_SECTORS * 512];
+    CHECK(RES_OK == disk_read(0, bitmap, fs.bitbase, BITMAP_SECTORS));
+
+    DWORD free = 0;
+    for (DWORD ibit = 0; ibit < CLUSTERS; ibit++)
+        if (!(bitmap[ibit / 8] >> ibit % 8 & 1)) free++;
+    return free;
+}
+
+/* the summary's total, without fatfs's own count to check it against */
+static DWORD checkpointed_free(void) {
+    fs.free_clst = 0xFFFFFFFF;
+    CHECK(0 == freespace_checkpoint());
+    return fs.free_clst;
+}
+
+int main(void) {
+    char path[] = "/tmp/freespace_test_XXXXXX";
+    const int fd = mkstemp(path);
+    if (-1 == fd || ftruncate(fd, 4 * 1024 * 1024) != 0 || -1 == sdcard_image_open(path)) {
+        perror(path);
+        return 1;
+    }
+    close(fd);
+
+    reset_volume();
+    CHECK(0 == disk_initialize(0));
+
+    /* boot sector with a serial number, the bitmap, and junk where the checkpoint would be */
+    unsigned char block[512] = { 0 };
+    memcpy(block + 100, "\x12\x34\x56\x78", 4);
+    CHECK(0 == spi_sd_write_blocks(block, 1, fs.volbase));
+
+    static unsigned char bitmap[BITMAP_SECTORS * 512];
+    memset(bitmap, 0xFF, USED_CLUSTERS / 8);
+    CHECK(0 == spi_sd_write_blocks(bitmap, BITMAP_SECTORS, fs.bitbase));
+    CHECK(0 == spi_sd_write_blocks(block, 1, fs.database + fs.csize * 3));
+
+    /* without a valid checkpoint, the bitmap is scanned */
+    CHECK(0 == freespace_mount(&fs, "reserved"));
+    CHECK(CLUSTERS - USED_CLUSTERS == fs.free_clst && USED_CLUSTERS + 1 == fs.last_clst);
+
+    /* changes in several regions, including a free, are tracked from the cached bitmap sectors */
+    CHECK(RES_OK == set_cluster_used(USED_CLUSTERS + 2, 1));
+    CHECK(RES_OK == set_cluster_used(200000, 1));
+    CHECK(RES_OK == set_cluster_used(3, 0));
+    CHECK(count_free() == checkpointed_free());
+
+    /* a remount trusts the checkpoint, reading only it and the two sampled bitmap sectors */
+    reset_volume();
+    size_t reads_before = sdcard_image_read_commands;
+    CHECK(0 == freespace_mount(&fs, "reserved"));
+    CHECK(sdcard_image_read_commands - reads_before <= 4);
+    CHECK(count_free() == fs.free_clst);
+
+    /* the first bitmap change marks the checkpoint dirty on the card with one extra write */
+    const size_t writes_before = sdcard_image_write_commands;
+    CHECK(RES_OK == set_cluster_used(250000, 1));
+    CHECK(RES_OK == set_cluster_used(250001, 1));
+    CHECK(3 == sdcard_image_write_commands - writes_before);
+
+    /* so a remount without a checkpoint, as after a crash, recounts */
+    reset_volume();
+    CHECK(0 == freespace_mount(&fs, "reserved"));
+    CHECK(count_free() == fs.free_clst);
+
+    /* if the checkpoint cannot be marked dirty, the bitmap write is refused, and the next one
+     tries again */
+    CHECK(0 == freespace_checkpoint());
+    const DWORD free_before = count_free();
+    sdcard_image_failing_writes = 1;
+    CHECK(RES_OK != set_cluster_used(100000, 1));
+    CHECK(count_free() == free_before);
+    reset_volume();
+    CHECK(0 == freespace_mount(&fs, "reserved"));
+    CHECK(free_before == fs.free_clst);
+    CHECK(RES_OK == set_cluster_used(100000, 1));
+    reset_volume();
+    CHECK(0 == freespace_mount(&fs, "reserved"));
+    CHECK(free_before - 1 == fs.free_clst);
+
+    /* a bitmap write which fails leaves its region to be recounted rather than adjusted */
+    sdcard_image_failing_writes = 5;
+    CHECK(RES_OK != set_cluster_used(100001, 1));
+    CHECK(count_free() == checkpointed_free());
+
+    /* another host allocating at the first free cluster invalidates the checkpoint */
+    CHECK(0 == freespace_unmount());
+    CHECK(RES_OK == set_cluster_used(3, 1));
+    reset_volume();
+    CHECK(0 == freespace_mount(&fs, "reserved"));
+    CHECK(count_free() == fs.free_clst);
+
+    /* the allocation hint can be pointed at a region with room */
+    CHECK(0 == freespace_seek_free(4000));
+    CHECK(fs.last_clst >= USED_CLUSTERS);
+    CHECK(-1 == freespace_seek_free(CLUSTERS));
+    CHECK(0 == freespace_unmount());
+
+    sdcard_image_close();
+    unlink(path);
+
+    if (failures) fprintf(stderr, "%zu failures\n", failures);
+    return failures ? 1 : 0;
+}
@@ -13,6 +13,9 @@
 #include <limits.h>
 #include <stdio.h>
 
+/* for sharing the card and the dmac channels between cooperative tasks */
+#include "coop_lock.h"
+
 #define IDMA_SPI_WRITE 2
 #define IDMA_SPI_READ 1
 
@@ -22,6 +25,159 @@ __attribute__((weak, aligned(16))) DmacDescriptor dmac_descriptors[8] = { 0 }, d
 extern void yield(void);
 __attribute((weak)) void yield(void) { }
 
+/* called from the dma completion isr, overridden by tasks.c to wake its scheduler */
+extern void spi_sd_dma_interrupt_hook(void);
+__attribute((weak)) void spi_sd_dma_interrupt_hook(void) { }
+
+/* held for the duration of each transaction, or from spi_sd_write_blocks_start until the
+ matching spi_sd_write_blocks_end or failed spi_sd_write_some_blocks */
+static struct coop_lock bus_lock;
+
+/* if set, writes return as soon as the card has accepted the data, rather than waiting for it
+ to finish programming. every command waits for the card to be ready anyway, so the wait is
+ simply deferred until the next command, a call to spi_sd_poll_ready(), or shutdown */
+static unsigned char lazy_busy = 0;
+
+/* set when the card was left busy programming by a lazy write, cleared once it is seen ready */
+static unsigned char card_busy = 0;
+
+/* if nonzero, an open multi-block write is ended and the bus handed over to waiting readers
+ once they have waited this many blocks, after which the write resumes with a new cmd25 */
+static unsigned long read_latency_blocks = 0;
+
+/* number of tasks waiting to read, either here or in a layer above which announced them */
+static volatile unsigned char reads_waiting = 0;
+
+/* blocks written by the open multi-block write since a read started waiting */
+static unsigned long blocks_while_read_waiting = 0;
+
+/* set while an open multi-block write has given up the bus to readers, during which nothing
+ else may write, so that writes still reach the card in the order they were started */
+static volatile unsigned char write_preempted = 0;
+
+/* called by a preempted write after it gives up the bus and before it takes it back, overridden
+ by diskio.c so that readers waiting on it can get in as well */
+extern void spi_sd_write_preempted_hook(void);
+__attribute((weak)) void spi_sd_write_preempted_hook(void) { }
+
+extern void spi_sd_write_resuming_hook(void);
+__attribute((weak)) void spi_sd_write_resuming_hook(void) { }
+
+/* for anything that writes to the card or would disrupt a preempted write */
+static void take_bus_for_write(void) {
+    while (write_preempted || !coop_lock_try(&bus_lock)) yield();
+}
+
+struct spi_sd_stats spi_sd_stats = { 0 };
+
+void spi_sd_stats_get(struct spi_sd_stats * out) {
+    *out = spi_sd_stats;
+}
+
+void spi_sd_stats_reset(void) {
+    spi_sd_stats = (struct spi_sd_stats) { 0 };
+}
+
+#ifdef SPI_SD_DEADLINE
+/* limits and records in cpu cycles */
+static uint32_t phase_limit_cycles[SPI_SD_PHASES];
+static uint32_t phase_worst_cycles[SPI_SD_PHASES];
+static unsigned long phase_forced_yields[SPI_SD_PHASES];
+
+/* phase in progress, SPI_SD_PHASES if none, and when this layer last yielded or was entered */
+static unsigned char phase = SPI_SD_PHASES;
+static uint32_t stretch_start;
+
+static void phase_record(const uint32_t now) {
+    if (phase < SPI_SD_PHASES && now - stretch_start > phase_worst_cycles[phase])
+        phase_worst_cycles[phase] = now - stretch_start;
+}
+
+/* returns the enclosing phase, to be passed to phase_end() */
+static unsigned char phase_begin(const unsigned char next) {
+    const uint32_t now = DWT->CYCCNT;
+    if (SPI_SD_PHASES == phase) stretch_start = now;
+    else phase_record(now);
+
+    const unsigned char outer = phase;
+    phase = next;
+    return outer;
+}
+
+static void phase_end(const unsigned char outer) {
+    phase_record(DWT->CYCCNT);
+    phase = outer;
+}
+
+/* other tasks may enter this layer while this one is yielded, and must find no phase in progress */
+static unsigned char phase_suspend(void) {
+    phase_record(DWT->CYCCNT);
+    const unsigned char suspended = phase;
+    phase = SPI_SD_PHASES;
+    return suspended;
+}
+
+static void phase_resume(const unsigned char suspended) {
+    phase = suspended;
+    stretch_start = DWT->CYCCNT;
+}
+
+/* for loops which yield on every pass anyway */
+static void phase_yield(void) {
+    const unsigned char suspended = phase_suspend();
+    yield();
+    phase_resume(suspended);
+}
+
+/* for loops which would otherwise spin without yielding */
+static void phase_poll(void) {
+    const uint32_t now = DWT->CYCCNT;
+    if (phase >= SPI_SD_PHASES || !phase_limit_cycles[phase] || now - stretch_start < phase_limit_cycles[phase])
+        return;
+
+    phase_forced_yields[phase]++;
+    const unsigned char suspended = phase_suspend();
+    __SEV(); yield();
+    phase_resume(suspended);
+}
+
+static void phase_init(void) {
+    /* enable the cycle counter */
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+void spi_sd_set_phase_limit_us(unsigned which, unsigned long us) {
+    const uint32_t cycles = us * (SystemCoreClock / 1000000);
+    for (size_t iphase = 0; iphase < SPI_SD_PHASES; iphase++)
+        if (SPI_SD_PHASES == which || iphase == which)
+            phase_limit_cycles[iphase] = cycles;
+}
+
+void spi_sd_phase_stats_get(struct spi_sd_phase_stats * out) {
+    const unsigned long cycles_per_us = SystemCoreClock / 1000000;
+    for (size_t iphase = 0; iphase < SPI_SD_PHASES; iphase++) {
+        out->worst_us[iphase] = phase_worst_cycles[iphase] / cycles_per_us;
+        out->forced_yields[iphase] = phase_forced_yields[iphase];
+    }
+}
+
+void spi_sd_phase_stats_reset(void) {
+    for (size_t iphase = 0; iphase < SPI_SD_PHASES; iphase++) {
+        phase_worst_cycles[iphase] = 0;
+        phase_forced_yields[iphase] = 0;
+    }
+}
+#else
+static void phase_init(void) { }
+static unsigned char phase_begin(const unsigned char next) { (void)next; return SPI_SD_PHASES; }
+static void phase_end(const unsigned char outer) { (void)outer; }
+static unsigned char phase_suspend(void) { return SPI_SD_PHASES; }
+static void phase_resume(const unsigned char suspended) { (void)suspended; }
+static void phase_yield(void) { yield(); }
+static void phase_poll(void) { }
+#endif
+
 static void spi_dma_init(void) {
     /* if dma has not yet been initted... */
     if (!DMAC->BASEADDR.bit.BASEADDR) {
@@ -105,7 +261,23 @@ static void spi_enable(void) {
     PORT->Group[1].PINCFG[23] = (PORT_PINCFG_Type) { .bit = { .PMUXEN = 1, .DRVSTR = 1 } };
 }
 
+static void wait_for_card_ready(void);
+
+/* optional accounting of where writes land, see below */
+static uint32_t heatmap_clock(void);
+static void heatmap_busy(const uint32_t cycles);
+
 void spi_sd_shutdown(void) {
+    take_bus_for_write();
+
+    /* do not cut the clock while the card is still programming a lazily written block */
+    if (card_busy) {
+        spi_enable();
+        cs_low();
+        wait_for_card_ready();
+        cs_high();
+    }
+
     DMAC->Channel[IDMA_SPI_WRITE].CHCTRLA.bit.ENABLE = 0;
     DMAC->Channel[IDMA_SPI_READ].CHCTRLA.bit.ENABLE = 0;
 
@@ -130,6 +302,8 @@ void spi_sd_shutdown(void) {
     PORT->Group[0].DIRCLR.reg = 1U << 17;
     PORT->Group[1].PINCFG[23].reg = 0;
     PORT->Group[1].DIRCLR.reg = 1U << 23;
+
+    coop_lock_give(&bus_lock);
 }
 
 static void spi_init() {
@@ -192,6 +366,8 @@ static void spi_init() {
 
     SERCOM1->SPI.CTRLC.bit.DATA32B = 1;
 
+    phase_init();
+
     /* this results in 400 kBd at 120 MHz, lower at lower */
     SERCOM1->SPI.BAUD.reg = 149;
 
@@ -209,6 +385,7 @@ __attribute((always_inline)) inline
 static uint8_t spi_receive_one_byte_with_rx_enabled(void) {
     while (!SERCOM1->SPI.INTFLAG.bit.DRE);
     SERCOM1->SPI.DATA.bit.DATA = 0xff;
+    spi_sd_stats.bytes_on_wire++;
 
     while (!SERCOM1->SPI.INTFLAG.bit.RXC);
     return SERCOM1->SPI.DATA.bit.DATA;
@@ -221,9 +398,13 @@ void DMAC_2_Handler(void) {
      without needing sevonpend */
     if (DMAC->Channel[IDMA_SPI_WRITE].CHINTFLAG.bit.TCMPL)
         DMAC->Channel[IDMA_SPI_WRITE].CHINTENCLR.reg = (DMAC_CHINTENCLR_Type) { .bit.TCMPL = 1 }.reg;
+
+    spi_sd_dma_interrupt_hook();
 }
 
 static void wait_for_card_ready(void) {
+    const unsigned char outer = phase_begin(SPI_SD_PHASE_BUSY);
+
     SERCOM1->SPI.CTRLB.bit.RXEN = 1;
     while (SERCOM1->SPI.SYNCBUSY.bit.CTRLB);
 
@@ -232,26 +413,37 @@ static void wait_for_card_ready(void) {
 
     while (!SERCOM1->SPI.INTFLAG.bit.DRE);
     SERCOM1->SPI.DATA.bit.DATA = 0xffffffff;
+    spi_sd_stats.bytes_on_wire += 4;
 
     while (!SERCOM1->SPI.INTFLAG.bit.RXC);
-    if (0xffffffff != SERCOM1->SPI.DATA.bit.DATA)
+    if (0xffffffff != SERCOM1->SPI.DATA.bit.DATA) {
+        const uint32_t busy_start = heatmap_clock();
+
         do {
             while (!SERCOM1->SPI.INTFLAG.bit.DRE);
             SERCOM1->SPI.DATA.bit.DATA = 0xffffffff;
+            spi_sd_stats.bytes_on_wire += 4;
 
-            while (!SERCOM1->SPI.INTFLAG.bit.RXC) { __SEV(); yield(); };
+            while (!SERCOM1->SPI.INTFLAG.bit.RXC) { __SEV(); phase_yield(); };
         } while (SERCOM1->SPI.DATA.bit.DATA != 0xffffffff);
 
+        heatmap_busy(heatmap_clock() - busy_start);
+    }
+
     while (!SERCOM1->SPI.INTFLAG.bit.TXC);
     SERCOM1->SPI.LENGTH.reg = (SERCOM_SPI_LENGTH_Type) { .bit.LENEN = 1, .bit.LEN = 1 }.reg;
     while (SERCOM1->SPI.SYNCBUSY.bit.LENGTH);
 
     SERCOM1->SPI.CTRLB.bit.RXEN = 0;
     while (SERCOM1->SPI.SYNCBUSY.bit.CTRLB);
+
+    card_busy = 0;
+    phase_end(outer);
 }
 
 static void spi_send(const void * buf, const size_t size) {
     const size_t whole_words = size / 4, rem = size % 4;
+    spi_sd_stats.bytes_on_wire += size;
 
     if (whole_words) {
         SERCOM1->SPI.LENGTH.reg = (SERCOM_SPI_LENGTH_Type) { .bit.LENEN = 0 }.reg;
@@ -260,6 +452,7 @@ static void spi_send(const void * buf, const size_t size) {
         for (size_t iword = 0; iword < whole_words; iword++) {
             while (!SERCOM1->SPI.INTFLAG.bit.DRE);
             SERCOM1->SPI.DATA.bit.DATA = ((const uint32_t *)buf)[iword];
+            phase_poll();
         }
 
         while (!SERCOM1->SPI.INTFLAG.bit.TXC);
@@ -281,36 +474,208 @@ static void spi_send(const void * buf, const size_t size) {
     while (SERCOM1->SPI.SYNCBUSY.bit.LENGTH);
 }
 
-static uint32_t spi_receive_uint32be(void) {
-    SERCOM1->SPI.LENGTH.reg = (SERCOM_SPI_LENGTH_Type) { .bit.LENEN = 0 }.reg;
-    while (SERCOM1->SPI.SYNCBUSY.bit.LENGTH);
-
+static uint8_t r1_response(void) {
     SERCOM1->SPI.CTRLB.bit.RXEN = 1;
     while (SERCOM1->SPI.SYNCBUSY.bit.CTRLB);
 
-    while (!SERCOM1->SPI.INTFLAG.bit.DRE);
-    SERCOM1->SPI.DATA.bit.DATA = 0xffffffff;
-
-    while (!SERCOM1->SPI.INTFLAG.bit.RXC);
-    const uint32_t bits = SERCOM1->SPI.DATA.bit.DATA;
+    uint8_t result, attempts = 0;
+    /* sd and mmc agree on max 8 attempts, mmc requires at least two attempts */
+    while (0xFF == (result = spi_receive_one_byte_with_rx_enabled()) && attempts++ < 8) phase_poll();
 
     while (!SERCOM1->SPI.INTFLAG.bit.TXC);
-    SERCOM1->SPI.LENGTH.reg = (SERCOM_SPI_LENGTH_Type) { .bit.LENEN = 1, .bit.LEN = 1 }.reg;
-    while (SERCOM1->SPI.SYNCBUSY.bit.LENGTH);
 
     SERCOM1->SPI.CTRLB.bit.RXEN = 0;
     while (SERCOM1->SPI.SYNCBUSY.bit.CTRLB);
 
-    return __builtin_bswap32(bits);
+    return result;
 }
 
-static uint8_t r1_response(void) {
+/* crc7 with polynomial 0b10001001 of each possible byte, left shifted by one */
+static const unsigned char crc7_table[256] = {
+    0x00, 0x12, 0x24, 0x36, 0x48, 0x5a, 0x6c, 0x7e, 0x90, 0x82, 0xb4, 0xa6, 0xd8, 0xca, 0xfc, 0xee,
+    0x32, 0x20, 0x16, 0x04, 0x7a, 0x68, 0x5e, 0x4c, 0xa2, 0xb0, 0x86, 0x94, 0xea, 0xf8, 0xce, 0xdc,
+    0x64, 0x76, 0x40, 0x52, 0x2c, 0x3e, 0x08, 0x1a, 0xf4, 0xe6, 0xd0, 0xc2, 0xbc, 0xae, 0x98, 0x8a,
+    0x56, 0x44, 0x72, 0x60, 0x1e, 0x0c, 0x3a, 0x28, 0xc6, 0xd4, 0xe2, 0xf0, 0x8e, 0x9c, 0xaa, 0xb8,
+    0xc8, 0xda, 0xec, 0xfe, 0x80, 0x92, 0xa4, 0xb6, 0x58, 0x4a, 0x7c, 0x6e, 0x10, 0x02, 0x34, 0x26,
+    0xfa, 0xe8, 0xde, 0xcc, 0xb2, 0xa0, 0x96, 0x84, 0x6a, 0x78, 0x4e, 0x5c, 0x22, 0x30, 0x06, 0x14,
+    0xac, 0xbe, 0x88, 0x9a, 0xe4, 0xf6, 0xc0, 0xd2, 0x3c, 0x2e, 0x18, 0x0a, 0x74, 0x66, 0x50, 0x42,
+    0x9e, 0x8c, 0xba, 0xa8, 0xd6, 0xc4, 0xf2, 0xe0, 0x0e, 0x1c, 0x2a, 0x38, 0x46, 0x54, 0x62, 0x70,
+    0x82, 0x90, 0xa6, 0xb4, 0xca, 0xd8, 0xee, 0xfc, 0x12, 0x00, 0x36, 0x24, 0x5a, 0x48, 0x7e, 0x6c,
+    0xb0, 0xa2, 0x94, 0x86, 0xf8, 0xea, 0xdc, 0xce, 0x20, 0x32, 0x04, 0x16, 0x68, 0x7a, 0x4c, 0x5e,
+    0xe6, 0xf4, 0xc2, 0xd0, 0xae, 0xbc, 0x8a, 0x98, 0x76, 0x64, 0x52, 0x40, 0x3e, 0x2c, 0x1a, 0x08,
+    0xd4, 0xc6, 0xf0, 0xe2, 0x9c, 0x8e, 0xb8, 0xaa, 0x44, 0x56, 0x60, 0x72, 0x0c, 0x1e, 0x28, 0x3a,
+    0x4a, 0x58, 0x6e, 0x7c, 0x02, 0x10, 0x26, 0x34, 0xda, 0xc8, 0xfe, 0xec, 0x92, 0x80, 0xb6, 0xa4,
+    0x78, 0x6a, 0x5c, 0x4e, 0x30, 0x22, 0x14, 0x06, 0xe8, 0xfa, 0xcc, 0xde, 0xa0, 0xb2, 0x84, 0x96,
+    0x2e, 0x3c, 0x0a, 0x18, 0x66, 0x74, 0x42, 0x50, 0xbe, 0xac, 0x9a, 0x88, 0xf6, 0xe4, 0xd2, 0xc0,
+    0x1c, 0x0e, 0x38, 0x2a, 0x54, 0x46, 0x70, 0x62, 0x8c, 0x9e, 0xa8, 0xba, 0xc4, 0xd6, 0xe0, 0xf2,
+};
+
+static unsigned char crc7_left_shifted(const unsigned char * restrict const message, const size_t length) {
+    unsigned char crc = 0;
+    for (size_t ibyte = 0; ibyte < length; ibyte++)
+        crc = crc7_table[crc ^ message[ibyte]];
+    return crc;
+}
+
+static void send_command_with_crc7(const uint8_t cmd, const uint32_t arg) {
+    unsigned char msg[6] = { cmd | 0x40, arg >> 24, arg >> 16, arg >> 8, arg, 0x01 };
+    msg[5] |= crc7_left_shifted(msg, 5);
+
+    spi_send(msg, 6);
+    spi_sd_stats.commands++;
+}
+
+/* polls for the r1 byte by byte, for commands after which the card sends a data block, the
+ start of which must not be clocked out along with the response */
+static uint8_t command_and_r1_response(const uint8_t cmd, const uint32_t arg) {
+    const unsigned char outer = phase_begin(SPI_SD_PHASE_COMMAND);
+    send_command_with_crc7(cmd, arg);
+    const uint8_t ret = r1_response();
+    phase_end(outer);
+    return ret;
+}
+
+/* full duplex transfer of a few whole words by dma, without yielding unless the enclosing phase
+ has run past its limit */
+static void spi_exchange_words(const uint32_t * tx, uint32_t * rx, const size_t words) {
+    SERCOM1->SPI.LENGTH.reg = (SERCOM_SPI_LENGTH_Type) { .bit.LENEN = 0 }.reg;
+    while (SERCOM1->SPI.SYNCBUSY.bit.LENGTH) phase_poll();
+
+    SERCOM1->SPI.CTRLB.bit.RXEN = 1;
+    while (SERCOM1->SPI.SYNCBUSY.bit.CTRLB) phase_poll();
+
+    *(((DmacDescriptor *)DMAC->BASEADDR.bit.BASEADDR) + IDMA_SPI_READ) = (DmacDescriptor) {
+        .BTCNT.reg = words,
+        .SRCADDR.reg = (size_t)&(SERCOM1->SPI.DATA.reg),
+        .DSTADDR.reg = ((size_t)rx) + 4 * words,
+        .BTCTRL = { .bit = {
+            .VALID = 1,
+            .BLOCKACT = DMAC_BTCTRL_BLOCKACT_INT_Val,
+            .SRCINC = 0,
+            .DSTINC = 1,
+            .BEATSIZE = DMAC_BTCTRL_BEATSIZE_WORD_Val,
+        }}
+    };
+
+    *(((DmacDescriptor *)DMAC->BASEADDR.bit.BASEADDR) + IDMA_SPI_WRITE) = (DmacDescriptor) {
+        .BTCNT.reg = words,
+        .SRCADDR.reg = ((size_t)tx) + 4 * words,
+        .DSTADDR.reg = (size_t)&(SERCOM1->SPI.DATA.reg),
+        .BTCTRL = { .bit = {
+            .VALID = 1,
+            .BLOCKACT = DMAC_BTCTRL_BLOCKACT_INT_Val,
+            .SRCINC = 1,
+            .DSTINC = 0,
+            .BEATSIZE = DMAC_BTCTRL_BEATSIZE_WORD_Val,
+        }}
+    };
+
+    /* clear pending interrupts from before, and leave the completion interrupts disabled */
+    DMAC->Channel[IDMA_SPI_READ].CHINTFLAG.reg = (DMAC_CHINTFLAG_Type) { .bit.TCMPL = 1 }.reg;
+    DMAC->Channel[IDMA_SPI_READ].CHINTENCLR.reg = (DMAC_CHINTENCLR_Type) { .bit.TCMPL = 1 }.reg;
+    DMAC->Channel[IDMA_SPI_WRITE].CHINTFLAG.reg = (DMAC_CHINTFLAG_Type) { .bit.TCMPL = 1 }.reg;
+    DMAC->Channel[IDMA_SPI_WRITE].CHINTENCLR.reg = (DMAC_CHINTENCLR_Type) { .bit.TCMPL = 1 }.reg;
+
+    /* ensure changes to descriptors have propagated to sram prior to enabling peripheral */
+    __DSB();
+
+    DMAC->Channel[IDMA_SPI_READ].CHCTRLA.bit.ENABLE = 1;
+    DMAC->Channel[IDMA_SPI_WRITE].CHCTRLA.bit.ENABLE = 1;
+
+    while (!(DMAC->Channel[IDMA_SPI_READ].CHINTFLAG.bit.TCMPL)) phase_poll();
+    DMAC->Channel[IDMA_SPI_READ].CHINTFLAG.reg = (DMAC_CHINTFLAG_Type) { .bit.TCMPL = 1 }.reg;
+    DMAC->Channel[IDMA_SPI_WRITE].CHINTFLAG.reg = (DMAC_CHINTFLAG_Type) { .bit.TCMPL = 1 }.reg;
+
+    while (!SERCOM1->SPI.INTFLAG.bit.TXC) phase_poll();
+    SERCOM1->SPI.LENGTH.reg = (SERCOM_SPI_LENGTH_Type) { .bit.LENEN = 1, .bit.LEN = 1 }.reg;
+    while (SERCOM1->SPI.SYNCBUSY.bit.LENGTH) phase_poll();
+
+    SERCOM1->SPI.CTRLB.bit.RXEN = 0;
+    while (SERCOM1->SPI.SYNCBUSY.bit.CTRLB) phase_poll();
+
+    __DSB();
+    spi_sd_stats.bytes_on_wire += 4 * words;
+}
+
+/* each command frame is the command itself, followed by enough 0xff bytes to clock out the
+ response within the eight bytes allowed for it to begin, the four further bytes of an r3 or
+ r7 response, and the byte the card requires between the end of a response and the next command.
+ the card never responds within the first byte after the command */
+#define COMMAND_FRAME_BYTES 20
+#define COMMAND_R1_FIRST 7
+#define COMMAND_R1_LAST 14
+
+/* commands which do not need to wait for the card in between can be sent in one transaction */
+#define COMMAND_BATCH_MAX 2
+
+struct sd_command {
+    uint8_t cmd;
+    uint32_t arg;
+};
+
+struct sd_response {
+    /* 0xff if the card did not respond */
+    uint8_t r1;
+
+    /* the four bytes following the r1, big endian, of which r2 uses the first and r3 and r7
+     use all */
+    uint32_t trailing;
+};
+
+static uint32_t command_tx[COMMAND_BATCH_MAX * COMMAND_FRAME_BYTES / 4], command_rx[COMMAND_BATCH_MAX * COMMAND_FRAME_BYTES / 4];
+
+static void commands_and_responses(const struct sd_command * cmds, const size_t count, struct sd_response * responses) {
+    const unsigned char outer = phase_begin(SPI_SD_PHASE_COMMAND);
+    unsigned char * tx = (unsigned char *)command_tx;
+    const unsigned char * rx = (const unsigned char *)command_rx;
+
+    for (size_t icmd = 0; icmd < count; icmd++) {
+        unsigned char * frame = tx + COMMAND_FRAME_BYTES * icmd;
+        frame[0] = cmds[icmd].cmd | 0x40;
+        frame[1] = cmds[icmd].arg >> 24;
+        frame[2] = cmds[icmd].arg >> 16;
+        frame[3] = cmds[icmd].arg >> 8;
+        frame[4] = cmds[icmd].arg;
+        frame[5] = crc7_left_shifted(frame, 5) | 0x01;
+
+        for (size_t ibyte = 6; ibyte < COMMAND_FRAME_BYTES; ibyte++)
+            frame[ibyte] = 0xff;
+    }
+
+    spi_exchange_words(command_tx, command_rx, count * COMMAND_FRAME_BYTES / 4);
+    spi_sd_stats.commands += count;
+
+    for (size_t icmd = 0; icmd < count; icmd++) {
+        const unsigned char * frame = rx + COMMAND_FRAME_BYTES * icmd;
+
+        /* the r1 is the first byte with the top bit clear */
+        size_t ibyte = COMMAND_R1_FIRST;
+        while (ibyte <= COMMAND_R1_LAST && frame[ibyte] & 0x80) ibyte++;
+
+        responses[icmd] = ibyte > COMMAND_R1_LAST ? (struct sd_response) { .r1 = 0xff, .trailing = 0xffffffff } :
+            (struct sd_response) {
+                .r1 = frame[ibyte],
+                .trailing = (uint32_t)frame[ibyte + 1] << 24 | (uint32_t)frame[ibyte + 2] << 16 |
+                            (uint32_t)frame[ibyte + 3] << 8 | frame[ibyte + 4]
+            };
+    }
+
+    phase_end(outer);
+}
+
+/* single command via the above, returning the r1 */
+static uint8_t command(const uint8_t cmd, const uint32_t arg, uint32_t * trailing) {
+    struct sd_response response;
+    commands_and_responses(&(struct sd_command) { .cmd = cmd, .arg = arg }, 1, &response);
+    if (trailing) *trailing = response.trailing;
+    return response.r1;
+}
+
+static uint8_t spi_receive_one_byte(void) {
     SERCOM1->SPI.CTRLB.bit.RXEN = 1;
     while (SERCOM1->SPI.SYNCBUSY.bit.CTRLB);
 
-    uint8_t result, attempts = 0;
-    /* sd and mmc agree on max 8 attempts, mmc requires at least two attempts */
-    while (0xFF == (result = spi_receive_one_byte_with_rx_enabled()) && attempts++ < 8);
+    const uint8_t result = spi_receive_one_byte_with_rx_enabled();
 
     while (!SERCOM1->SPI.INTFLAG.bit.TXC);
 
@@ -320,41 +685,365 @@ static uint8_t r1_response(void) {
     return result;
 }
 
-static unsigned char crc7_left_shifted(const unsigned char * restrict const message, const size_t length) {
-    const unsigned char polynomial = 0b10001001;
-    unsigned char crc = 0;
+static uint16_t crc16(const unsigned char * restrict const message, const size_t length) {
+    uint16_t crc = 0;
 
     for (size_t ibyte = 0; ibyte < length; ibyte++) {
-        crc ^= message[ibyte];
+        crc ^= message[ibyte] << 8U;
 
         for (size_t ibit = 0; ibit < 8; ibit++)
-            crc = (crc & 0x80u) ? (crc << 1) ^ (polynomial << 1) : (crc << 1);
+            crc = (crc & 0x8000u) ? (crc << 1) ^ 0x1021 : (crc << 1);
     }
 
-    return crc & 0xfe;
+    return crc;
 }
 
-static void send_command_with_crc7(const uint8_t cmd, const uint32_t arg) {
-    unsigned char msg[6] = { cmd | 0x40, arg >> 24, arg >> 16, arg >> 8, arg, 0x01 };
-    msg[5] |= crc7_left_shifted(msg, 5);
+/* polled receive of a short data block such as a register, as opposed to a sector */
+static int receive_data_block(unsigned char * buf, const size_t size) {
+    SERCOM1->SPI.CTRLB.bit.RXEN = 1;
+    while (SERCOM1->SPI.SYNCBUSY.bit.CTRLB);
 
-    spi_send(msg, 6);
+    uint8_t token;
+    size_t attempts = 0;
+    unsigned char outer = phase_begin(SPI_SD_PHASE_TOKEN);
+    while (0xFF == (token = spi_receive_one_byte_with_rx_enabled()) && attempts++ < 1U << 20) phase_poll();
+    phase_end(outer);
+
+    uint16_t crc_received = 0;
+    if (0xFE == token) {
+        outer = phase_begin(SPI_SD_PHASE_TRANSFER);
+        for (size_t ibyte = 0; ibyte < size; ibyte++) {
+            buf[ibyte] = spi_receive_one_byte_with_rx_enabled();
+            phase_poll();
+        }
+
+        crc_received = spi_receive_one_byte_with_rx_enabled() << 8U;
+        crc_received |= spi_receive_one_byte_with_rx_enabled();
+        phase_end(outer);
+    }
+
+    while (!SERCOM1->SPI.INTFLAG.bit.TXC);
+
+    SERCOM1->SPI.CTRLB.bit.RXEN = 0;
+    while (SERCOM1->SPI.SYNCBUSY.bit.CTRLB);
+
+    return 0xFE == token && crc16(buf, size) == crc_received ? 0 : -1;
 }
 
-static uint8_t command_and_r1_response(const uint8_t cmd, const uint32_t arg) {
-    send_command_with_crc7(cmd, arg);
-    return r1_response();
+/* reads a register that the card returns as a data block: csd via cmd9, sd status and scr
+ via acmd13 and acmd51, or switch function status via cmd6 */
+static int read_register(const uint8_t cmd, const int app_cmd, const uint32_t arg, unsigned char * buf, const size_t size) {
+    if (app_cmd) {
+        cs_low();
+        wait_for_card_ready();
+
+        const uint8_t cmd55_r1_response = command(55, 0, NULL);
+        cs_high();
+
+        if (cmd55_r1_response > 1) return -1;
+    }
+
+    cs_low();
+    wait_for_card_ready();
+
+    if (command_and_r1_response(cmd, arg) != 0) {
+        cs_high();
+        return -1;
+    }
+
+    /* acmd13 responds with r2, the second byte of which is not needed here */
+    if (app_cmd && 13 == cmd)
+        (void)spi_receive_one_byte();
+
+    const int ret = receive_data_block(buf, size);
+    cs_high();
+    return ret;
+}
+
+/* size of the allocation unit in blocks, from the AU_SIZE field of the sd status register */
+static unsigned long au_blocks_from_sd_status(const unsigned char status[64]) {
+    static const unsigned long au_kib[16] = { 0, 16, 32, 64, 128, 256, 512, 1024, 2048, 4096,
+        8192, 12288, 16384, 24576, 32768, 65536 };
+    return au_kib[status[10] >> 4] * 2;
+}
+
+/* capacity in blocks, from the C_SIZE field(s) of the csd register */
+static unsigned long long card_blocks_from_csd(const unsigned char csd[16]) {
+    if (csd[0] >> 6) {
+        /* csd version 2.0 and later, for sdhc and sdxc */
+        const unsigned long c_size = (csd[7] & 0x3FUL) << 16 | csd[8] << 8U | csd[9];
+        return (c_size + 1ULL) * 1024;
+    } else {
+        const unsigned long c_size = (csd[6] & 0x3UL) << 10 | csd[7] << 2U | csd[8] >> 6;
+        const unsigned c_size_mult = (csd[9] & 0x3U) << 1 | csd[10] >> 7;
+        const unsigned read_bl_len = csd[5] & 0xFU;
+        return (c_size + 1ULL) << (c_size_mult + 2 + read_bl_len - 9);
+    }
+}
+
+/* zero if unknown, in which case writes are not split */
+static unsigned long au_blocks = 0;
+
+/* zero if unknown */
+static unsigned long long card_blocks = 0;
+
+/* value of every byte after an erase, from the DATA_STAT_AFTER_ERASE bit of the scr */
+static unsigned char erase_fill = 0;
+
+/* address of the next block of the currently open multi-block write, and the number of blocks
+ sent since its cmd25 */
+static unsigned long long open_write_address;
+static unsigned long open_write_blocks;
+
+/* blocks announced by the last acmd23, which applies to the next cmd25, and how many of those
+ remain to be written in the current one, to be announced again if it is split */
+static unsigned long pre_erase_blocks = 0, open_pre_erase_blocks = 0;
+
+/* fastest baud register value that the card accepted during init, before any reduction */
+static uint8_t fastest_baud = 1;
+
+/* as passed to the last init, and whether it succeeded. the card keeps its state, including
+ block length, crc checking, and high speed mode, for as long as it remains powered */
+static unsigned baud_reduction = 0;
+static unsigned char card_initted = 0;
+
+#ifdef SPI_SD_HEATMAP
+/* allocation units recently written to, and how far into each, standing in for the few that a
+ card can keep open at once. writes behind the furthest point, or into the middle of one not
+ among these, are those the card is likely to handle by copying the whole allocation unit */
+#define HEATMAP_OPEN_AUS 8
+
+static struct spi_sd_heatmap heatmap;
+
+static struct {
+    unsigned long long au;
+    unsigned long end;
+} open_aus[HEATMAP_OPEN_AUS];
+static size_t open_aus_count = 0, open_aus_next = 0;
+
+/* the burst in progress, if its number of blocks is nonzero */
+static struct {
+    unsigned long long au, next_address;
+    unsigned long blocks, rewritten_blocks, end_before;
+    unsigned char misaligned;
+    uint32_t busy_cycles;
+} burst;
+
+/* where busy time goes once the burst it belongs to has ended, if anywhere */
+static struct spi_sd_heatmap_bin * last_bin = NULL;
+static struct spi_sd_heatmap_length * last_length = NULL;
+
+/* when the size of the allocation unit is unknown, assume 4 MiB */
+static unsigned long heatmap_au_blocks(void) {
+    return au_blocks ? au_blocks : 8192;
+}
+
+static void heatmap_geometry(void) {
+    const unsigned long long aus = (card_blocks + heatmap_au_blocks() - 1) / heatmap_au_blocks();
+    heatmap.aus_per_bin = aus > SPI_SD_HEATMAP_BINS ? (aus + SPI_SD_HEATMAP_BINS - 1) / SPI_SD_HEATMAP_BINS : 1;
+
+    /* enable the cycle counter */
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+static struct spi_sd_heatmap_bin * heatmap_bin(const unsigned long long au) {
+    const unsigned long long ibin = au / heatmap.aus_per_bin;
+    return heatmap.bins + (ibin < SPI_SD_HEATMAP_BINS ? ibin : SPI_SD_HEATMAP_BINS - 1);
+}
+
+static void heatmap_burst_end(void) {
+    if (!burst.blocks) return;
+
+    size_t ilength = 0;
+    while (ilength + 1 < SPI_SD_HEATMAP_LENGTHS && burst.blocks >> (ilength + 1)) ilength++;
+
+    last_bin = heatmap_bin(burst.au);
+    last_bin->blocks += burst.blocks;
+    last_bin->bursts++;
+    last_bin->rewritten_blocks += burst.rewritten_blocks;
+    last_bin->misaligned_bursts += burst.misaligned;
+    last_bin->busy_cycles += burst.busy_cycles;
+
+    last_length = heatmap.lengths + ilength;
+    last_length->bursts++;
+    last_length->misaligned_bursts += burst.misaligned;
+    last_length->rewritten_blocks += burst.rewritten_blocks;
+    last_length->busy_cycles += burst.busy_cycles;
+
+    heatmap.blocks_written += burst.blocks;
+    heatmap.blocks_programmed += burst.misaligned || burst.rewritten_blocks ? heatmap_au_blocks() : burst.blocks;
+
+    /* remember how far into the allocation unit has now been written */
+    const unsigned long end = (burst.next_address - 1) % heatmap_au_blocks() + 1;
+    size_t iopen = 0;
+    while (iopen < open_aus_count && open_aus[iopen].au != burst.au) iopen++;
+
+    if (iopen == open_aus_count) {
+        if (open_aus_count < HEATMAP_OPEN_AUS) open_aus_count++;
+        else {
+            iopen = open_aus_next;
+            open_aus_next = (open_aus_next + 1) % HEATMAP_OPEN_AUS;
+        }
+        open_aus[iopen].au = burst.au;
+        open_aus[iopen].end = 0;
+    }
+    if (open_aus[iopen].end < end) open_aus[iopen].end = end;
+
+    burst.blocks = 0;
+}
+
+/* called for each block once the card has accepted it */
+static void heatmap_block(const unsigned long long address) {
+    const unsigned long long au = address / heatmap_au_blocks();
+    const unsigned long offset = address % heatmap_au_blocks();
+
+    if (burst.blocks && (au != burst.au || address != burst.next_address))
+        heatmap_burst_end();
+
+    if (!burst.blocks) {
+        size_t iopen = 0;
+        while (iopen < open_aus_count && open_aus[iopen].au != au) iopen++;
+
+        burst.au = au;
+        burst.rewritten_blocks = 0;
+        burst.busy_cycles = 0;
+        burst.end_before = iopen < open_aus_count ? open_aus[iopen].end : 0;
+        burst.misaligned = iopen == open_aus_count && offset;
+    }
+
+    if (offset < burst.end_before) burst.rewritten_blocks++;
+    burst.blocks++;
+    burst.next_address = address + 1;
+}
+
+static uint32_t heatmap_clock(void) {
+    return DWT->CYCCNT;
+}
+
+/* busy time is charged to the burst being written, or else to the last one, since the card is
+ only ever left busy by a write. time the card spent busy while the cpu did something else,
+ with lazy busy waits, is not counted */
+static void heatmap_busy(const uint32_t cycles) {
+    if (burst.blocks) burst.busy_cycles += cycles;
+    else if (last_bin) {
+        last_bin->busy_cycles += cycles;
+        last_length->busy_cycles += cycles;
+    }
+}
+
+/* erasing resets the allocation units involved, and the busy time that follows is its own */
+static void heatmap_erase(const unsigned long long block_address, const unsigned long blocks) {
+    heatmap_burst_end();
+    last_bin = NULL;
+    last_length = NULL;
+
+    const unsigned long long first_au = block_address / heatmap_au_blocks();
+    const unsigned long long last_au = (block_address + blocks - 1) / heatmap_au_blocks();
+    for (size_t iopen = 0; iopen < open_aus_count; iopen++)
+        if (open_aus[iopen].au >= first_au && open_aus[iopen].au <= last_au)
+            open_aus[iopen].end = 0;
+}
+
+void spi_sd_heatmap_get(struct spi_sd_heatmap * out) {
+    *out = heatmap;
+}
+
+void spi_sd_heatmap_reset(void) {
+    heatmap = (struct spi_sd_heatmap) { 0 };
+    burst.blocks = 0;
+    last_bin = NULL;
+    last_length = NULL;
+    open_aus_count = 0;
+    open_aus_next = 0;
+    heatmap_geometry();
+}
+
+void spi_sd_heatmap_logical_write(const unsigned long long block_address, const unsigned long blocks) {
+    heatmap_bin(block_address / heatmap_au_blocks())->logical_blocks += blocks;
+}
+
+void spi_sd_heatmap_dump(void) {
+    const unsigned long cycles_per_us = SystemCoreClock / 1000000;
+    const struct spi_sd_heatmap h = heatmap;
+
+    dprintf(2, "heatmap: %lu au(s) of %lu blocks per bin, %llu blocks written, %llu programmed\r\n",
+            h.aus_per_bin, heatmap_au_blocks(), h.blocks_written, h.blocks_programmed);
+
+    for (size_t ibin = 0; ibin < SPI_SD_HEATMAP_BINS; ibin++) {
+        const struct spi_sd_heatmap_bin * bin = h.bins + ibin;
+        if (!bin->logical_blocks && !bin->blocks) continue;
+        dprintf(2, "bin %u: logical %lu, blocks %lu, bursts %lu, rewritten %lu, misaligned %lu, busy %llu us\r\n",
+                (unsigned)ibin, bin->logical_blocks, bin->blocks, bin->bursts, bin->rewritten_blocks,
+                bin->misaligned_bursts, bin->busy_cycles / cycles_per_us);
+    }
+
+    for (size_t ilength = 0; ilength < SPI_SD_HEATMAP_LENGTHS; ilength++) {
+        const struct spi_sd_heatmap_length * length = h.lengths + ilength;
+        if (!length->bursts) continue;
+        dprintf(2, "length %lu+: bursts %lu, rewritten %lu, misaligned %lu, busy %llu us\r\n",
+                1UL << ilength, length->bursts, length->rewritten_blocks, length->misaligned_bursts,
+                length->busy_cycles / cycles_per_us);
+    }
+}
+#else
+static void heatmap_geometry(void) { }
+static void heatmap_burst_end(void) { }
+static void heatmap_block(const unsigned long long address) { (void)address; }
+static uint32_t heatmap_clock(void) { return 0; }
+static void heatmap_busy(const uint32_t cycles) { (void)cycles; }
+static void heatmap_erase(const unsigned long long block_address, const unsigned long blocks) { (void)block_address; (void)blocks; }
+#endif
+
+/* smallest baud register value whose sck frequency, which is half the gclk0 frequency divided
+ by one more than the register value, does not exceed the given limit. never faster than
+ mclk/4, which is as fast as this driver has been shown to work */
+static uint8_t baud_for_hz(const unsigned long hz) {
+    const unsigned long divisor = (SystemCoreClock + 2 * hz - 1) / (2 * hz);
+    return divisor < 2 ? 1 : divisor > 256 ? 255 : divisor - 1;
+}
+
+/* cmd6 in check mode to see if the card supports high speed, then in switch mode to select it.
+ returns zero if the card is now in high speed mode */
+static int switch_to_high_speed(const unsigned char csd[16], const unsigned char scr[8]) {
+    /* cmd6 requires command class 10 and at least version 1.10 of the physical layer spec */
+    const unsigned ccc = (unsigned)csd[4] << 4 | csd[5] >> 4;
+    if (!(ccc & 1U << 10) || !(scr[0] & 0xF)) return -1;
+
+    unsigned char status[64];
+
+    /* function group 1 (access mode), function 1 (high speed), other groups unchanged. the
+     support bits for group 1 are in byte 13, and the function that would be selected is in
+     the low nibble of byte 16, which reads as 0xF if it cannot be */
+    if (-1 == read_register(6, 0, 0x00FFFFF1, status, 64) ||
+        !(status[13] & 1U << 1) || 1 != (status[16] & 0xF))
+        return -1;
+
+    if (-1 == read_register(6, 0, 0x80FFFFF1, status, 64) || 1 != (status[16] & 0xF))
+        return -1;
+
+    /* the card switches within eight clocks after the end of the status block */
+    spi_send((unsigned char[1]) { 0xff }, 1);
+
+    return 0;
 }
 
 void spi_sd_restore_baud_rate(void) {
-    /* use mclk/4 as the baud rate */
-    SERCOM1->SPI.BAUD.reg = 1;
+    coop_lock_take(&bus_lock);
+
+    /* use the fastest rate the card accepted during init */
+    SERCOM1->SPI.BAUD.reg = fastest_baud;
+
+    coop_lock_give(&bus_lock);
 }
 
-int spi_sd_init(unsigned baud_rate_reduction) {
+static int init_unlocked(unsigned baud_rate_reduction) {
     /* NOTE: we need to not call this until it has been about 1 ms since power was applied */
     spi_init();
 
+    card_initted = 0;
+    baud_reduction = baud_rate_reduction;
+
     /* clear miso */
     cs_low();
     spi_send((unsigned char[1]) { 0xff }, 1);
@@ -373,13 +1062,13 @@ int spi_sd_init(unsigned baud_rate_reduction) {
         cs_low();
 
         /* send cmd0 */
-        const uint8_t cmd0_r1_response = command_and_r1_response(0, 0);
+        const uint8_t cmd0_r1_response = command(0, 0, NULL);
         cs_high();
 
         if (0x01 == cmd0_r1_response) break;
 
         /* give other stuff a chance to run if we are looping */
-        __SEV(); yield();
+        __SEV(); phase_yield();
     }
 
     /* cmd8, check voltage range and test pattern */
@@ -389,26 +1078,23 @@ int spi_sd_init(unsigned baud_rate_reduction) {
             spi_disable();
             return -1;
         }
+        phase_poll();
         cs_low();
         wait_for_card_ready();
 
-        const uint8_t r1_response = command_and_r1_response(8, 0x1AA);
-
-        if (0x1 != r1_response) {
-            cs_high();
-            continue;
-        }
-
-        const uint32_t response = spi_receive_uint32be();
+        uint32_t response;
+        const uint8_t r1_response = command(8, 0x1AA, &response);
         cs_high();
 
+        if (0x1 != r1_response) continue;
+
         if (0x1AA == response) break;
     }
 
     /* cmd59, re-enable crc feature, which is disabled by cmd0 */
     cs_low();
     wait_for_card_ready();
-    if (command_and_r1_response(59, 1) > 1) {
+    if (command(59, 1, NULL) > 1) {
         cs_high();
         spi_disable();
         return -1;
@@ -422,26 +1108,23 @@ int spi_sd_init(unsigned baud_rate_reduction) {
             spi_disable();
             return -1;
         }
+        phase_poll();
         cs_low();
         wait_for_card_ready();
 
-        const uint8_t cmd55_r1_response = command_and_r1_response(55, 0);
-        cs_high();
-
-        if (cmd55_r1_response > 1) continue;
-
-        cs_low();
-        wait_for_card_ready();
-
-        const uint8_t acmd41_r1_response = command_and_r1_response(41, 1U << 30);
+        /* cmd55 and acmd41 as one transaction */
+        struct sd_response responses[2];
+        commands_and_responses((struct sd_command[2]) { { 55, 0 }, { 41, 1U << 30 } }, 2, responses);
         cs_high();
 
-        if (!acmd41_r1_response) break;
+        if (responses[0].r1 > 1) continue;
+        if (!responses[1].r1) break;
     }
 
-    /* now bump the baud rate up to the max allowable speed (mclk/4) */
+    /* now bump the baud rate up to the max allowed in default speed mode, 25 MHz */
+    fastest_baud = baud_for_hz(25000000);
     spi_disable();
-    SERCOM1->SPI.BAUD.reg = 1 + baud_rate_reduction;
+    SERCOM1->SPI.BAUD.reg = fastest_baud + baud_rate_reduction;
     spi_enable();
 
     /* TODO: if any of the following fail, restart the procedure with a lower baud rate */
@@ -449,19 +1132,40 @@ int spi_sd_init(unsigned baud_rate_reduction) {
         /* cmd58, read ocr register */
         cs_low();
         wait_for_card_ready();
-        if (command_and_r1_response(58, 0) > 1) break;
-
-        const unsigned int ocr = spi_receive_uint32be();
+        uint32_t ocr;
+        if (command(58, 0, &ocr) > 1) break;
         (void)ocr;
         cs_high();
 
         /* cmd16, set block length to 512 */
         cs_low();
         wait_for_card_ready();
-        if (command_and_r1_response(16, 512) > 1) break;
+        if (command(16, 512, NULL) > 1) break;
         cs_high();
 
+        /* learn the geometry of the card, but carry on without it if this fails */
+        unsigned char status[64];
+        au_blocks = -1 != read_register(13, 1, 0, status, 64) ? au_blocks_from_sd_status(status) : 0;
+
+        unsigned char csd[16];
+        const int have_csd = -1 != read_register(9, 0, 0, csd, 16);
+        card_blocks = have_csd ? card_blocks_from_csd(csd) : 0;
+
+        unsigned char scr[8];
+        const int have_scr = -1 != read_register(51, 1, 0, scr, 8);
+        erase_fill = have_scr && scr[1] >> 7 ? 0xFF : 0;
+        heatmap_geometry();
+
+        /* if the card accepts high speed mode, go up to the 50 MHz it then allows */
+        if (have_csd && have_scr && -1 != switch_to_high_speed(csd, scr)) {
+            fastest_baud = baud_for_hz(50000000);
+            spi_disable();
+            SERCOM1->SPI.BAUD.reg = fastest_baud + baud_rate_reduction;
+            spi_enable();
+        }
+
         /* we get here on overall success of this function */
+        card_initted = 1;
         cs_high();
         spi_disable();
         return 0;
@@ -473,73 +1177,288 @@ int spi_sd_init(unsigned baud_rate_reduction) {
     return -1;
 }
 
-int spi_sd_write_blocks_start(unsigned long long block_address) {
+int spi_sd_init(unsigned baud_rate_reduction) {
+    coop_lock_take(&bus_lock);
+    const unsigned char outer = phase_begin(SPI_SD_PHASE_INIT);
+    const int ret = init_unlocked(baud_rate_reduction);
+    phase_end(outer);
+    coop_lock_give(&bus_lock);
+    return ret;
+}
+
+static int resume_unlocked(void) {
+    if (!card_initted) return init_unlocked(baud_reduction);
+
+    /* restore sercom and dmac, and go straight to the rate negotiated during init */
+    spi_init();
+    spi_disable();
+    SERCOM1->SPI.BAUD.reg = fastest_baud + baud_reduction;
+    spi_enable();
+
+    cs_low();
+    wait_for_card_ready();
+
+    /* cmd13, which responds with r2, both bytes of which are zero if the card is in the
+     transfer state with nothing to report. a card that is absent responds with 0xff */
+    uint32_t trailing;
+    const uint8_t r1_response = command(13, 0, &trailing);
+    const uint8_t status = trailing >> 24;
+    cs_high();
+    spi_disable();
+
+    if (!r1_response && !status) return 0;
+
+    /* card was removed, power cycled, or otherwise lost its state */
+    dprintf(2, "%s: warm resume failed, reinitializing\r\n", __func__);
+    return init_unlocked(baud_reduction);
+}
+
+int spi_sd_resume(void) {
+    coop_lock_take(&bus_lock);
+    const unsigned char outer = phase_begin(SPI_SD_PHASE_INIT);
+    const int ret = resume_unlocked();
+    phase_end(outer);
+    coop_lock_give(&bus_lock);
+    return ret;
+}
+
+static int write_blocks_start_unlocked(unsigned long long block_address) {
     spi_enable();
     cs_low();
     wait_for_card_ready();
 
-    const uint8_t response = command_and_r1_response(25, block_address);
+    /* the frame includes at least the one extra byte required prior to the data packet */
+    const uint8_t response = command(25, block_address, NULL);
     if (response != 0) {
         cs_high();
         spi_disable();
         return -1;
     }
 
-    /* extra byte prior to data packet */
-    spi_send((unsigned char[1]) { 0xff }, 1);
+    open_write_address = block_address;
+    open_write_blocks = 0;
+    blocks_while_read_waiting = 0;
+    open_pre_erase_blocks = pre_erase_blocks;
+    pre_erase_blocks = 0;
 
     return 0;
 }
 
-void spi_sd_write_blocks_end(void) {
-    /* send stop tran token */
-    spi_send((unsigned char[2]) { 0xfd, 0xff }, 2);
+int spi_sd_write_blocks_start(unsigned long long block_address) {
+    take_bus_for_write();
 
-    wait_for_card_ready();
+    if (-1 == write_blocks_start_unlocked(block_address)) {
+        coop_lock_give(&bus_lock);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void write_blocks_end_unlocked(void) {
+    /* the card must have finished programming the last block before it sees the stop token */
+    if (card_busy) wait_for_card_ready();
+    heatmap_burst_end();
+
+    /* send stop tran token */
+    spi_send((unsigned char[2]) { 0xfd, 0xff }, 2);
+
+    if (lazy_busy) card_busy = 1;
+    else wait_for_card_ready();
 
     cs_high();
     spi_disable();
 }
 
-int spi_sd_write_pre_erase(unsigned long blocks) {
+void spi_sd_write_blocks_end(void) {
+    write_blocks_end_unlocked();
+    coop_lock_give(&bus_lock);
+}
+
+void spi_sd_set_lazy_busy(int enable) {
+    lazy_busy = enable ? 1 : 0;
+}
+
+int spi_sd_poll_ready(void) {
+    if (!card_busy) return 1;
+
+    /* the bus is in use, possibly by an open write stream, so the card is not known to be ready */
+    if (!coop_lock_try(&bus_lock)) return 0;
+
     spi_enable();
     cs_low();
-    wait_for_card_ready();
 
-    const uint8_t cmd55_r1_response = command_and_r1_response(55, 0);
+    /* the card holds its output low for as long as it is busy */
+    if (0xff == spi_receive_one_byte()) card_busy = 0;
+
     cs_high();
+    spi_disable();
+
+    coop_lock_give(&bus_lock);
+    return !card_busy;
+}
+
+unsigned long spi_sd_au_blocks(void) {
+    return au_blocks;
+}
+
+unsigned long long spi_sd_card_blocks(void) {
+    return card_blocks;
+}
+
+unsigned char spi_sd_erase_fill(void) {
+    return erase_fill;
+}
+
+static int erase_blocks_unlocked(unsigned long long block_address, unsigned long blocks) {
+    heatmap_erase(block_address, blocks);
+    spi_enable();
+
+    cs_low();
+    wait_for_card_ready();
 
-    if (cmd55_r1_response > 1) {
+    /* cmd32 and cmd33 set the first and last blocks, as one transaction */
+    struct sd_response responses[2];
+    commands_and_responses((struct sd_command[2]) { { 32, block_address }, { 33, block_address + blocks - 1 } }, 2, responses);
+
+    /* cmd38 erases them */
+    if (responses[0].r1 || responses[1].r1 || command(38, 0, NULL)) {
+        cs_high();
         spi_disable();
         return -1;
     }
 
+    /* cmd38 responds with r1b, this can take a while and will yield */
+    wait_for_card_ready();
+    cs_high();
+
+    spi_disable();
+    return 0;
+}
+
+int spi_sd_erase_blocks(unsigned long long block_address, unsigned long blocks) {
+    if (!blocks) return 0;
+
+    take_bus_for_write();
+    const int ret = erase_blocks_unlocked(block_address, blocks);
+    coop_lock_give(&bus_lock);
+    return ret;
+}
+
+unsigned long spi_sd_plan_burst(unsigned long long block_address, unsigned long blocks) {
+    if (!au_blocks) return blocks;
+
+    const unsigned long until_boundary = au_blocks - block_address % au_blocks;
+    return blocks < until_boundary ? blocks : until_boundary;
+}
+
+static int write_pre_erase_unlocked(unsigned long blocks) {
+    spi_enable();
     cs_low();
     wait_for_card_ready();
 
-    const uint8_t acmd23_r1_response = command_and_r1_response(23, blocks);
+    /* cmd55 and acmd23 as one transaction */
+    struct sd_response responses[2];
+    commands_and_responses((struct sd_command[2]) { { 55, 0 }, { 23, blocks } }, 2, responses);
 
     cs_high();
     spi_disable();
 
-    return acmd23_r1_response ? -1 : 0;
+    if (responses[0].r1 > 1 || responses[1].r1) return -1;
+    pre_erase_blocks = blocks;
+    return 0;
 }
 
-int spi_sd_write_some_blocks(const void * buf, const unsigned long blocks) {
+int spi_sd_write_pre_erase(unsigned long blocks) {
+    take_bus_for_write();
+    const int ret = write_pre_erase_unlocked(blocks);
+    coop_lock_give(&bus_lock);
+    return ret;
+}
+
+void spi_sd_set_read_latency_bound(unsigned long blocks) {
+    read_latency_blocks = blocks;
+}
+
+void spi_sd_reader_waiting(void) {
+    reads_waiting++;
+}
+
+void spi_sd_reader_done_waiting(void) {
+    reads_waiting--;
+}
+
+/* starts a new cmd25 where the one just ended left off. the card forgets an acmd23 at the end of
+ the cmd25 it applied to, so it is repeated with the number of announced blocks not yet written */
+static int write_blocks_restart_unlocked(void) {
+    /* the pre-erase is only a hint, and the cmd25 will fail anyway if the card is in trouble */
+    if (open_pre_erase_blocks) (void)write_pre_erase_unlocked(open_pre_erase_blocks);
+    return write_blocks_start_unlocked(open_write_address);
+}
+
+/* ends the open multi-block write, lets waiting readers have the bus, and then starts a new
+ cmd25 where the old one left off. on failure the bus has been released */
+static int preempt_for_reads(void) {
+    write_blocks_end_unlocked();
+
+    /* the readers let in will have phases of their own */
+    const unsigned char suspended = phase_suspend();
+    write_preempted = 1;
+    coop_lock_give(&bus_lock);
+    spi_sd_write_preempted_hook();
+
+    /* each reader stops counting itself as waiting once it has taken the lock it waited on */
+    while (reads_waiting) { __SEV(); yield(); }
+
+    spi_sd_write_resuming_hook();
+    coop_lock_take(&bus_lock);
+    write_preempted = 0;
+    phase_resume(suspended);
+
+    if (-1 == write_blocks_restart_unlocked()) {
+        coop_lock_give(&bus_lock);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* with buf null, each block is the given word repeated, streamed from a single copy of it */
+static int write_some_blocks_unlocked(const void * buf, const uint32_t fill, const unsigned long blocks, uint16_t * const crcs) {
     for (size_t iblock = 0; iblock < blocks; iblock++) {
         const unsigned char * block = buf ? (void *)((unsigned char *)buf + 512 * iblock) : NULL;
 
+        /* at a block boundary, let readers in if they have waited long enough */
+        if (read_latency_blocks && reads_waiting && blocks_while_read_waiting >= read_latency_blocks &&
+            -1 == preempt_for_reads())
+            return -1;
+
+        /* a burst crossing an allocation unit boundary is the main cause of long busy periods,
+         so end the current cmd25 and start another at each boundary */
+        if (au_blocks && open_write_blocks && !(open_write_address % au_blocks)) {
+            write_blocks_end_unlocked();
+            if (-1 == write_blocks_restart_unlocked()) {
+                coop_lock_give(&bus_lock);
+                return -1;
+            }
+        }
+
+        /* a lazy write of the previous block may have left the card busy */
+        if (card_busy) wait_for_card_ready();
+
         while (!SERCOM1->SPI.INTFLAG.bit.DRE);
         SERCOM1->SPI.DATA.bit.DATA = 0xfc;
 
+        /* start token, data, crc, and data response */
+        spi_sd_stats.bytes_on_wire += 1 + 512 + 2 + 1;
+
         while (!SERCOM1->SPI.INTFLAG.bit.TXC);
         SERCOM1->SPI.LENGTH.reg = (SERCOM_SPI_LENGTH_Type) { .bit.LENEN = 0 }.reg;
         while (SERCOM1->SPI.SYNCBUSY.bit.LENGTH);
 
-        static const uint32_t zero_word = 0;
         *(((DmacDescriptor *)DMAC->BASEADDR.bit.BASEADDR) + IDMA_SPI_WRITE) = (DmacDescriptor) {
             .BTCNT.reg = 512 / 4,
-            .SRCADDR.reg = block ? ((size_t)block) + 512 : (size_t)&zero_word,
+            .SRCADDR.reg = block ? ((size_t)block) + 512 : (size_t)&fill,
             .DSTADDR.reg = (size_t)&(SERCOM1->SPI.DATA.reg),
             .BTCTRL = { .bit = {
                 .VALID = 1,
@@ -567,12 +1486,13 @@ int spi_sd_write_some_blocks(const void * buf, const unsigned long blocks) {
         /* setting this starts the transaction */
         DMAC->Channel[IDMA_SPI_WRITE].CHCTRLA.bit.ENABLE = 1;
 
-        while (!DMAC->Channel[IDMA_SPI_WRITE].CHINTFLAG.bit.TCMPL) yield();
+        while (!DMAC->Channel[IDMA_SPI_WRITE].CHINTFLAG.bit.TCMPL) phase_yield();
         DMAC->Channel[IDMA_SPI_WRITE].CHINTFLAG.reg = (DMAC_CHINTFLAG_Type) { .bit.TCMPL = 1 }.reg;
 
         /* grab the CRC that the DMAC calculated on the outgoing 512 bytes... */
         while (DMAC->CRCSTATUS.bit.CRCBUSY);
         const uint16_t crc = DMAC->CRCCHKSUM.reg;
+        if (crcs) crcs[iblock] = crc;
 
         /* need to wait on TXC before updating the LENGTH register */
         while (!SERCOM1->SPI.INTFLAG.bit.TXC);
@@ -600,25 +1520,67 @@ int spi_sd_write_some_blocks(const void * buf, const unsigned long blocks) {
 
         while (!SERCOM1->SPI.INTFLAG.bit.RXC);
         const unsigned char response = SERCOM1->SPI.DATA.bit.DATA & 0b11111;
-
-        /* this leaves sercom in rx disabled, one byte mode */
-        wait_for_card_ready();
+        spi_sd_stats.data_responses[(response >> 1) & 0b111]++;
 
         if (0b00101 != response) {
-            if (0b01011 == response)
+            /* this leaves sercom in rx disabled, one byte mode */
+            wait_for_card_ready();
+
+            if (0b01011 == response) {
+                spi_sd_stats.write_crc_errors++;
                 dprintf(2, "%s: bad crc\r\n", __func__);
+            }
             else
                 dprintf(2, "%s: error 0x%x\r\n", __func__, response);
 
             cs_high();
             spi_disable();
+            coop_lock_give(&bus_lock);
             return -1;
         }
+
+        heatmap_block(open_write_address);
+
+        if (lazy_busy) {
+            /* leave the card programming the block, and leave sercom as wait_for_card_ready would */
+            while (!SERCOM1->SPI.INTFLAG.bit.TXC);
+            SERCOM1->SPI.CTRLB.bit.RXEN = 0;
+            while (SERCOM1->SPI.SYNCBUSY.bit.CTRLB);
+            card_busy = 1;
+        }
+        else
+            /* this leaves sercom in rx disabled, one byte mode */
+            wait_for_card_ready();
+
+        spi_sd_stats.last_successful_write_block_address = open_write_address;
+        open_write_address++;
+        open_write_blocks++;
+        if (open_pre_erase_blocks) open_pre_erase_blocks--;
+        if (reads_waiting) blocks_while_read_waiting++;
     }
 
     return 0;
 }
 
+static int write_some_blocks(const void * buf, const uint32_t fill, const unsigned long blocks, uint16_t * const crcs) {
+    const unsigned char outer = phase_begin(SPI_SD_PHASE_TRANSFER);
+    const int ret = write_some_blocks_unlocked(buf, fill, blocks, crcs);
+    phase_end(outer);
+    return ret;
+}
+
+int spi_sd_write_some_blocks_with_crcs(const void * buf, const unsigned long blocks, uint16_t * crcs) {
+    return write_some_blocks(buf, 0, blocks, crcs);
+}
+
+int spi_sd_write_some_blocks(const void * buf, const unsigned long blocks) {
+    return write_some_blocks(buf, 0, blocks, NULL);
+}
+
+int spi_sd_write_some_blocks_fill(const uint32_t fill, const unsigned long blocks) {
+    return write_some_blocks(NULL, fill, blocks, NULL);
+}
+
 int spi_sd_write_blocks(const void * buf, const unsigned long blocks, const unsigned long long block_address) {
     if (-1 == spi_sd_write_blocks_start(block_address) ||
         -1 == spi_sd_write_some_blocks(buf, blocks))
@@ -629,7 +1591,158 @@ int spi_sd_write_blocks(const void * buf, const unsigned long blocks, const unsi
     return 0;
 }
 
-int spi_sd_read_blocks(void * buf, unsigned long blocks, unsigned long long block_address) {
+int spi_sd_write_blocks_vectored(const struct spi_sd_write_segment * segments, size_t count, const unsigned long long block_address) {
+    if (-1 == spi_sd_write_blocks_start(block_address)) return -1;
+
+    /* the dma descriptor is rewritten for every block anyway, so segments cost nothing extra */
+    for (size_t isegment = 0; isegment < count; isegment++)
+        if (-1 == write_some_blocks(segments[isegment].buf, segments[isegment].fill, segments[isegment].blocks, segments[isegment].crcs))
+            return -1;
+
+    spi_sd_write_blocks_end();
+
+    return 0;
+}
+
+/* clocks out bytes until the start of a data block, returns -1 if the card sends an error
+ token instead of a data token */
+static int receive_data_token(void) {
+    uint8_t result;
+    /* this can loop for a while */
+    const unsigned char outer = phase_begin(SPI_SD_PHASE_TOKEN);
+    while (0xFF == (result = spi_receive_one_byte_with_rx_enabled())) phase_poll();
+    phase_end(outer);
+
+    return 0xFE == result ? 0 : -1;
+}
+
+/* after the data token, starts the dma of the rest of the block into the given buffer, and
+ returns without waiting for it to finish */
+static void receive_data_dma_start(uint32_t * restrict const block) {
+    while (!SERCOM1->SPI.INTFLAG.bit.TXC);
+    SERCOM1->SPI.LENGTH.reg = (SERCOM_SPI_LENGTH_Type) { .bit.LENEN = 0 }.reg;
+    while (SERCOM1->SPI.SYNCBUSY.bit.LENGTH);
+
+    /* data and crc */
+    spi_sd_stats.bytes_on_wire += 512 + 2;
+
+    *(((DmacDescriptor *)DMAC->BASEADDR.bit.BASEADDR) + IDMA_SPI_READ) = (DmacDescriptor) {
+        .BTCNT.reg = 512 / 4,
+        .SRCADDR.reg = (size_t)&(SERCOM1->SPI.DATA.reg),
+        .DSTADDR.reg = ((size_t)block) + 512,
+        .BTCTRL = { .bit = {
+            .VALID = 1,
+            .BLOCKACT = DMAC_BTCTRL_BLOCKACT_INT_Val,
+            .SRCINC = 0,
+            .DSTINC = 1, /* write to the same register every time */
+            .BEATSIZE = DMAC_BTCTRL_BEATSIZE_WORD_Val, /* transfer 32 bits per beat */
+        }}
+    };
+
+    /* clear pending interrupt from before */
+    DMAC->Channel[IDMA_SPI_READ].CHINTFLAG.reg = (DMAC_CHINTFLAG_Type) { .bit.TCMPL = 1 }.reg;
+
+    DMAC->Channel[IDMA_SPI_READ].CHINTENCLR.reg = (DMAC_CHINTENCLR_Type) { .bit.TCMPL = 1 }.reg;
+
+    /* reset the crc */
+    DMAC->CRCCTRL.reg = (DMAC_CRCCTRL_Type) { .bit.CRCSRC = 0 }.reg;
+    DMAC->CRCCHKSUM.reg = 0;
+    DMAC->CRCCTRL.reg = (DMAC_CRCCTRL_Type) { .bit.CRCSRC = 0x20 + IDMA_SPI_READ }.reg;
+
+    static const uint32_t dummy = 0xffffffff;
+    *(((DmacDescriptor *)DMAC->BASEADDR.bit.BASEADDR) + IDMA_SPI_WRITE) = (DmacDescriptor) {
+        .BTCNT.reg = 512 / 4,
+        .SRCADDR.reg = (size_t)&dummy,
+        .DSTADDR.reg = (size_t)&(SERCOM1->SPI.DATA.reg),
+        .BTCTRL = { .bit = {
+            .VALID = 1,
+            .BLOCKACT = DMAC_BTCTRL_BLOCKACT_INT_Val,
+            .SRCINC = 0,
+            .DSTINC = 0, /* write to the same register every time */
+            .BEATSIZE = DMAC_BTCTRL_BEATSIZE_WORD_Val, /* transfer 32 bits per beat */
+        }}
+    };
+
+    /* clear pending interrupt from before */
+    DMAC->Channel[IDMA_SPI_WRITE].CHINTFLAG.reg = (DMAC_CHINTFLAG_Type) { .bit.TCMPL = 1 }.reg;
+
+    /* enable interrupt on write completion */
+    DMAC->Channel[IDMA_SPI_WRITE].CHINTENSET.reg = (DMAC_CHINTENSET_Type) { .bit.TCMPL = 1 }.reg;
+
+    /* ensure changes to descriptors have propagated to sram prior to enabling peripheral */
+    __DSB();
+
+    /* setting this starts the transaction */
+    DMAC->Channel[IDMA_SPI_READ].CHCTRLA.bit.ENABLE = 1;
+    DMAC->Channel[IDMA_SPI_WRITE].CHCTRLA.bit.ENABLE = 1;
+}
+
+/* nonblocking, whether the dma started above has finished clocking out the block */
+static int receive_data_dma_done(void) {
+    return DMAC->Channel[IDMA_SPI_WRITE].CHINTFLAG.bit.TCMPL;
+}
+
+/* waits for the dma started above, then receives the crc of the block and checks it, storing
+ the crc if asked to */
+static int receive_data_dma_finish(uint16_t * const crc_out) {
+    /* yield/sleep here until dma write transaction finishes */
+    while (!(DMAC->Channel[IDMA_SPI_WRITE].CHINTFLAG.bit.TCMPL)) phase_yield();
+    DMAC->Channel[IDMA_SPI_WRITE].CHINTFLAG.reg = (DMAC_CHINTFLAG_Type) { .bit.TCMPL = 1 }.reg;
+
+    /* busy loop for the last little bit until the read transaction finishes */
+    while (!(DMAC->Channel[IDMA_SPI_READ].CHINTFLAG.bit.TCMPL));
+    DMAC->Channel[IDMA_SPI_READ].CHINTFLAG.reg = (DMAC_CHINTFLAG_Type) { .bit.TCMPL = 1 }.reg;
+    DMAC->Channel[IDMA_SPI_READ].CHINTENCLR.reg = (DMAC_CHINTENCLR_Type) { .bit.TCMPL = 1 }.reg;
+
+    /* grab the CRC that the DMAC calculated on the outgoing 512 bytes... */
+    while (DMAC->CRCSTATUS.bit.CRCBUSY);
+    const uint16_t crc = DMAC->CRCCHKSUM.reg;
+
+    while (!SERCOM1->SPI.INTFLAG.bit.TXC);
+    SERCOM1->SPI.LENGTH.reg = (SERCOM_SPI_LENGTH_Type) { .bit.LENEN = 1, .bit.LEN = 2 }.reg;
+    while (SERCOM1->SPI.SYNCBUSY.bit.LENGTH);
+
+    /* read and discard two crc bytes */
+    while (!SERCOM1->SPI.INTFLAG.bit.DRE);
+    SERCOM1->SPI.DATA.bit.DATA = 0xFFFF;
+
+    while (!SERCOM1->SPI.INTFLAG.bit.RXC);
+    const uint16_t crc_swapped = SERCOM1->SPI.DATA.bit.DATA;
+    const uint16_t crc_received = __builtin_bswap16(crc_swapped);
+
+    while (!SERCOM1->SPI.INTFLAG.bit.TXC);
+    SERCOM1->SPI.LENGTH.reg = (SERCOM_SPI_LENGTH_Type) { .bit.LENEN = 1, .bit.LEN = 1 }.reg;
+    while (SERCOM1->SPI.SYNCBUSY.bit.LENGTH);
+
+    if (crc_received != crc) {
+        spi_sd_stats.read_crc_errors++;
+        dprintf(2, "%s: bad crc\r\n", __func__);
+        return -1;
+    }
+
+    if (crc_out) *crc_out = crc;
+    return 0;
+}
+
+/* for any failure partway through a read, with rx enabled */
+static void read_abort(void) {
+    while (!SERCOM1->SPI.INTFLAG.bit.TXC);
+    SERCOM1->SPI.CTRLB.bit.RXEN = 0;
+    while (SERCOM1->SPI.SYNCBUSY.bit.CTRLB);
+
+    cs_high();
+    spi_disable();
+}
+
+static int read_blocks_unlocked(const struct spi_sd_read_segment * segments, const size_t count, unsigned long long block_address) {
+    unsigned long blocks = 0;
+    for (size_t isegment = 0; isegment < count; isegment++)
+        blocks += segments[isegment].blocks;
+
+    /* position within the list of segments of the next block to be received */
+    const struct spi_sd_read_segment * segment = segments;
+    unsigned long iblock_in_segment = 0;
+
     spi_enable();
     cs_low();
     wait_for_card_ready();
@@ -646,133 +1759,286 @@ int spi_sd_read_blocks(void * buf, unsigned long blocks, unsigned long long bloc
 
     /* clock out the response in 1 + 512 + 2 byte blocks */
     for (size_t iblock = 0; iblock < blocks; iblock++) {
-        uint8_t result;
-        /* this can loop for a while */
-        while (0xFF == (result = spi_receive_one_byte_with_rx_enabled()));
+        if (-1 == receive_data_token()) {
+            read_abort();
+            return -1;
+        }
 
-        /* when we break out of the above loop, we've read the Data Token byte */
-        if (0xFE != result) {
-            while (!SERCOM1->SPI.INTFLAG.bit.TXC);
-            SERCOM1->SPI.CTRLB.bit.RXEN = 0;
-            while (SERCOM1->SPI.SYNCBUSY.bit.CTRLB);
+        /* retarget the dma at the next segment once this one is full */
+        while (iblock_in_segment == segment->blocks) {
+            segment++;
+            iblock_in_segment = 0;
+        }
 
-            cs_high();
-            spi_disable();
+        uint16_t * const crc = segment->crcs ? segment->crcs + iblock_in_segment : NULL;
+        receive_data_dma_start(((uint32_t *)segment->buf) + 128 * iblock_in_segment++);
+
+        if (-1 == receive_data_dma_finish(crc)) {
+            read_abort();
             return -1;
         }
+    }
 
-        while (!SERCOM1->SPI.INTFLAG.bit.TXC);
-        SERCOM1->SPI.LENGTH.reg = (SERCOM_SPI_LENGTH_Type) { .bit.LENEN = 0 }.reg;
-        while (SERCOM1->SPI.SYNCBUSY.bit.LENGTH);
+    SERCOM1->SPI.CTRLB.bit.RXEN = 0;
+    while (SERCOM1->SPI.SYNCBUSY.bit.CTRLB);
 
-        uint32_t * restrict const block = ((uint32_t *)buf) + 128 * iblock;
+    /* if we sent cmd18, send cmd12 to stop */
+    if (blocks > 1) {
+        /* the byte after cmd12 is the remnant of the data block being sent, and is skipped */
+        (void)command(12, 0, NULL);
+        wait_for_card_ready();
+    }
 
-        *(((DmacDescriptor *)DMAC->BASEADDR.bit.BASEADDR) + IDMA_SPI_READ) = (DmacDescriptor) {
-            .BTCNT.reg = 512 / 4,
-            .SRCADDR.reg = (size_t)&(SERCOM1->SPI.DATA.reg),
-            .DSTADDR.reg = ((size_t)block) + 512,
-            .BTCTRL = { .bit = {
-                .VALID = 1,
-                .BLOCKACT = DMAC_BTCTRL_BLOCKACT_INT_Val,
-                .SRCINC = 0,
-                .DSTINC = 1, /* write to the same register every time */
-                .BEATSIZE = DMAC_BTCTRL_BEATSIZE_WORD_Val, /* transfer 32 bits per beat */
-            }}
-        };
+    cs_high();
+    spi_disable();
 
-        /* clear pending interrupt from before */
-        DMAC->Channel[IDMA_SPI_READ].CHINTFLAG.reg = (DMAC_CHINTFLAG_Type) { .bit.TCMPL = 1 }.reg;
+    return 0;
+}
 
-        DMAC->Channel[IDMA_SPI_READ].CHINTENCLR.reg = (DMAC_CHINTENCLR_Type) { .bit.TCMPL = 1 }.reg;
+int spi_sd_read_blocks(void * buf, unsigned long blocks, unsigned long long block_address) {
+    return spi_sd_read_blocks_vectored(&(struct spi_sd_read_segment) { .buf = buf, .blocks = blocks }, 1, block_address);
+}
 
-        /* reset the crc */
-        DMAC->CRCCTRL.reg = (DMAC_CRCCTRL_Type) { .bit.CRCSRC = 0 }.reg;
-        DMAC->CRCCHKSUM.reg = 0;
-        DMAC->CRCCTRL.reg = (DMAC_CRCCTRL_Type) { .bit.CRCSRC = 0x20 + IDMA_SPI_READ }.reg;
+/* readers count themselves as waiting, so that an open multi-block write may be preempted */
+static void take_bus_for_read(void) {
+    if (!coop_lock_try(&bus_lock)) {
+        spi_sd_reader_waiting();
+        coop_lock_take(&bus_lock);
+        spi_sd_reader_done_waiting();
+    }
+}
 
-        static const uint32_t dummy = 0xffffffff;
-        *(((DmacDescriptor *)DMAC->BASEADDR.bit.BASEADDR) + IDMA_SPI_WRITE) = (DmacDescriptor) {
-            .BTCNT.reg = 512 / 4,
-            .SRCADDR.reg = (size_t)&dummy,
-            .DSTADDR.reg = (size_t)&(SERCOM1->SPI.DATA.reg),
-            .BTCTRL = { .bit = {
-                .VALID = 1,
-                .BLOCKACT = DMAC_BTCTRL_BLOCKACT_INT_Val,
-                .SRCINC = 0,
-                .DSTINC = 0, /* write to the same register every time */
-                .BEATSIZE = DMAC_BTCTRL_BEATSIZE_WORD_Val, /* transfer 32 bits per beat */
-            }}
-        };
+int spi_sd_read_blocks_vectored(const struct spi_sd_read_segment * segments, size_t count, unsigned long long block_address) {
+    take_bus_for_read();
 
-        /* clear pending interrupt from before */
-        DMAC->Channel[IDMA_SPI_WRITE].CHINTFLAG.reg = (DMAC_CHINTFLAG_Type) { .bit.TCMPL = 1 }.reg;
+    const unsigned char outer = phase_begin(SPI_SD_PHASE_TRANSFER);
+    const int ret = read_blocks_unlocked(segments, count, block_address);
+    phase_end(outer);
 
-        /* enable interrupt on write completion */
-        DMAC->Channel[IDMA_SPI_WRITE].CHINTENSET.reg = (DMAC_CHINTENSET_Type) { .bit.TCMPL = 1 }.reg;
+    coop_lock_give(&bus_lock);
+    return ret;
+}
 
-        /* ensure changes to descriptors have propagated to sram prior to enabling peripheral */
-        __DSB();
+/* state of the open read stream. slots of the ring from stream_tail onward hold stream_filled
+ received blocks, the first stream_taken of which have been handed to the consumer, and if
+ stream_receiving is set, the slot after them is being filled by dma */
+static uint32_t (* stream_ring)[128];
+static unsigned long stream_ring_blocks;
+static unsigned long stream_tail, stream_filled, stream_taken;
+static unsigned char stream_receiving = 0;
 
-        /* setting this starts the transaction */
-        DMAC->Channel[IDMA_SPI_READ].CHCTRLA.bit.ENABLE = 1;
-        DMAC->Channel[IDMA_SPI_WRITE].CHCTRLA.bit.ENABLE = 1;
+/* address of the next block to be received, or of the start of the next cmd18 */
+static unsigned long long stream_address;
 
-        /* yield/sleep here until dma write transaction finishes */
-        while (!(DMAC->Channel[IDMA_SPI_WRITE].CHINTFLAG.bit.TCMPL)) yield();
-        DMAC->Channel[IDMA_SPI_WRITE].CHINTFLAG.reg = (DMAC_CHINTFLAG_Type) { .bit.TCMPL = 1 }.reg;
+/* set while a cmd18 is in progress, during which the stream holds the bus */
+static unsigned char stream_open = 0;
+static unsigned char stream_failed = 0;
 
-        /* busy loop for the last little bit until the read transaction finishes */
-        while (!(DMAC->Channel[IDMA_SPI_READ].CHINTFLAG.bit.TCMPL));
-        DMAC->Channel[IDMA_SPI_READ].CHINTFLAG.reg = (DMAC_CHINTFLAG_Type) { .bit.TCMPL = 1 }.reg;
-        DMAC->Channel[IDMA_SPI_READ].CHINTENCLR.reg = (DMAC_CHINTENCLR_Type) { .bit.TCMPL = 1 }.reg;
+/* sends cmd18 at the current stream address, with the bus already held. on failure the bus
+ has been released */
+static int read_stream_begin(void) {
+    spi_enable();
+    cs_low();
+    wait_for_card_ready();
 
-        /* grab the CRC that the DMAC calculated on the outgoing 512 bytes... */
-        while (DMAC->CRCSTATUS.bit.CRCBUSY);
-        const uint16_t crc = DMAC->CRCCHKSUM.reg;
+    if (command_and_r1_response(18, stream_address) != 0) {
+        cs_high();
+        spi_disable();
+        coop_lock_give(&bus_lock);
+        stream_failed = 1;
+        return -1;
+    }
 
-        while (!SERCOM1->SPI.INTFLAG.bit.TXC);
-        SERCOM1->SPI.LENGTH.reg = (SERCOM_SPI_LENGTH_Type) { .bit.LENEN = 1, .bit.LEN = 2 }.reg;
-        while (SERCOM1->SPI.SYNCBUSY.bit.LENGTH);
+    SERCOM1->SPI.CTRLB.bit.RXEN = 1;
+    while (SERCOM1->SPI.SYNCBUSY.bit.CTRLB);
 
-        /* read and discard two crc bytes */
-        while (!SERCOM1->SPI.INTFLAG.bit.DRE);
-        SERCOM1->SPI.DATA.bit.DATA = 0xFFFF;
+    stream_open = 1;
+    return 0;
+}
 
-        while (!SERCOM1->SPI.INTFLAG.bit.RXC);
-        const uint16_t crc_swapped = SERCOM1->SPI.DATA.bit.DATA;
-        const uint16_t crc_received = __builtin_bswap16(crc_swapped);
+/* with no block in flight, sends cmd12 and gives up the bus */
+static void read_stream_end(void) {
+    SERCOM1->SPI.CTRLB.bit.RXEN = 0;
+    while (SERCOM1->SPI.SYNCBUSY.bit.CTRLB);
 
-        while (!SERCOM1->SPI.INTFLAG.bit.TXC);
-        SERCOM1->SPI.LENGTH.reg = (SERCOM_SPI_LENGTH_Type) { .bit.LENEN = 1, .bit.LEN = 1 }.reg;
-        while (SERCOM1->SPI.SYNCBUSY.bit.LENGTH);
+    /* the byte after cmd12 is the remnant of the data block being sent, and is skipped */
+    (void)command(12, 0, NULL);
+    wait_for_card_ready();
 
-        if (crc_received != crc) {
-            SERCOM1->SPI.CTRLB.bit.RXEN = 0;
-            while (SERCOM1->SPI.SYNCBUSY.bit.CTRLB);
+    cs_high();
+    spi_disable();
 
-            cs_high();
-            spi_disable();
-            dprintf(2, "%s: bad crc\r\n", __func__);
+    stream_open = 0;
+    coop_lock_give(&bus_lock);
+}
+
+static void read_stream_fail(void) {
+    read_abort();
+    stream_open = 0;
+    stream_receiving = 0;
+    stream_failed = 1;
+    coop_lock_give(&bus_lock);
+}
+
+/* clocks out at most the given number of bytes looking for the start of a data block. returns 0
+ once it is found, 1 if not yet, or -1 if the card sends an error token instead */
+static int poll_data_token(size_t tries) {
+    while (tries--) {
+        const uint8_t result = spi_receive_one_byte_with_rx_enabled();
+        if (0xFF != result) return 0xFE == result ? 0 : -1;
+    }
+
+    return 1;
+}
+
+/* bytes of the gap between blocks clocked out per call when not waiting. the rest of the gap is
+ left for the next call */
+#ifndef READ_STREAM_TOKEN_TRIES
+#define READ_STREAM_TOKEN_TRIES 16
+#endif
+
+/* set while a task is moving the stream along, which may yield partway through */
+static volatile unsigned char stream_busy = 0;
+
+static void stream_take_busy(void) {
+    while (stream_busy) { __SEV(); yield(); }
+    stream_busy = 1;
+}
+
+/* moves the stream along as far as it can go without waiting, or if asked to wait, until the
+ next block has arrived. blocks are retired as their dma finishes and the next started while
+ there is room for it. the card is stopped once the ring is full, and restarted once half of
+ it is free, or whenever asked to wait */
+static int read_stream_advance(const int wait) {
+    while (1) {
+        if (stream_receiving) {
+            if (!wait && !receive_data_dma_done()) return 0;
+
+            stream_receiving = 0;
+            if (-1 == receive_data_dma_finish(NULL)) {
+                read_stream_fail();
+                return -1;
+            }
+
+            stream_filled++;
+            stream_address++;
+
+            /* the block waited for has arrived */
+            if (wait) return 0;
+        }
+
+        if (stream_filled == stream_ring_blocks) {
+            if (stream_open) read_stream_end();
+            return 0;
+        }
+
+        if (!stream_open) {
+            if (wait) {
+                const unsigned char suspended = phase_suspend();
+                take_bus_for_read();
+                phase_resume(suspended);
+            }
+            else if (stream_filled > stream_ring_blocks / 2 || !coop_lock_try(&bus_lock)) return 0;
+
+            if (-1 == read_stream_begin()) return -1;
+        }
+
+        /* the gap before the next block is usually short, but is bounded here anyway */
+        const int ret = wait ? receive_data_token() : poll_data_token(READ_STREAM_TOKEN_TRIES);
+        if (-1 == ret) {
+            read_stream_fail();
             return -1;
         }
+        else if (ret) return 0;
+
+        receive_data_dma_start(stream_ring[(stream_tail + stream_filled) % stream_ring_blocks]);
+        stream_receiving = 1;
     }
+}
 
-    SERCOM1->SPI.CTRLB.bit.RXEN = 0;
-    while (SERCOM1->SPI.SYNCBUSY.bit.CTRLB);
+int spi_sd_read_stream_open(void * ring, unsigned long ring_blocks, unsigned long long block_address) {
+    /* only one stream at a time, and a failed one must still be closed */
+    if (stream_ring) return -1;
+
+    stream_ring = ring;
+    stream_ring_blocks = ring_blocks;
+    stream_tail = 0;
+    stream_filled = 0;
+    stream_taken = 0;
+    stream_receiving = 0;
+    stream_address = block_address;
+    stream_failed = 0;
+    stream_busy = 0;
+
+    take_bus_for_read();
+    const unsigned char outer = phase_begin(SPI_SD_PHASE_TRANSFER);
+    const int ret = -1 == read_stream_begin() ? -1 : read_stream_advance(0);
+    phase_end(outer);
+
+    return ret;
+}
 
-    /* if we sent cmd18, send cmd12 to stop */
-    if (blocks > 1) {
-        send_command_with_crc7(12, 0);
+int spi_sd_read_stream_poll(void) {
+    if (stream_busy) return 0;
+    if (stream_failed || !stream_ring) return -1;
 
-        /* CMD12 wants an extra byte prior to the response */
-        spi_send((unsigned char[1]) { 0xff }, 1);
+    stream_busy = 1;
+    const unsigned char outer = phase_begin(SPI_SD_PHASE_TRANSFER);
+    const int ret = read_stream_advance(0);
+    phase_end(outer);
+    stream_busy = 0;
 
-        (void)r1_response();
-        wait_for_card_ready();
+    return ret;
+}
+
+const void * spi_sd_read_stream_take(void) {
+    stream_take_busy();
+
+    const void * block = NULL;
+    const unsigned char outer = phase_begin(SPI_SD_PHASE_TRANSFER);
+
+    if (stream_ring && !stream_failed && stream_taken != stream_ring_blocks) {
+        int ret = 0;
+        while (stream_filled == stream_taken && -1 != ret)
+            ret = read_stream_advance(1);
+
+        if (-1 != ret) {
+            block = stream_ring[(stream_tail + stream_taken++) % stream_ring_blocks];
+
+            /* keep the card sending while the caller works on this block. a failure here is
+             reported by the next call instead */
+            (void)read_stream_advance(0);
+        }
     }
 
-    cs_high();
-    spi_disable();
+    phase_end(outer);
+    stream_busy = 0;
+    return block;
+}
 
-    return 0;
+void spi_sd_read_stream_release(void) {
+    if (!stream_taken) return;
+
+    /* the slot being filled, if any, is stream_tail + stream_filled, which this leaves alone */
+    stream_tail = (stream_tail + 1) % stream_ring_blocks;
+    stream_filled--;
+    stream_taken--;
+}
+
+int spi_sd_read_stream_close(void) {
+    stream_take_busy();
+    const unsigned char outer = phase_begin(SPI_SD_PHASE_TRANSFER);
+
+    if (stream_receiving) {
+        stream_receiving = 0;
+        if (-1 == receive_data_dma_finish(NULL)) read_stream_fail();
+    }
+
+    if (stream_open) read_stream_end();
+
+    phase_end(outer);
+    stream_busy = 0;
+
+    stream_ring = NULL;
+    return stream_failed ? -1 : 0;
 }
@@ -1,4 +1,5 @@
 #include <stdint.h>
+#include <stddef.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -8,6 +9,11 @@ int spi_sd_init(unsigned baud_rate_reduction);
 void spi_sd_shutdown(void);
 void spi_sd_restore_baud_rate(void);
 
+/* for use after spi_sd_shutdown() while the card has remained powered. restores the spi and dma
+ configuration and checks the card with a single cmd13, falling back to a full spi_sd_init()
+ with the same baud rate reduction as last time if the card does not respond as expected */
+int spi_sd_resume(void);
+
 /* these are blocking, but internally call yield() */
 int spi_sd_read_blocks(void * buf, unsigned long blocks, unsigned long long block_address);
 
@@ -16,10 +22,199 @@ int spi_sd_write_blocks_start(unsigned long long block_address);
 int spi_sd_write_some_blocks(const void * buf, const unsigned long blocks);
 void spi_sd_write_blocks_end(void);
 
+/* as above, also storing the crc16 of each block as computed by the dmac on its way to the card,
+ which is the same crc the card checks, in the given array of one per block */
+int spi_sd_write_some_blocks_with_crcs(const void * buf, const unsigned long blocks, uint16_t * crcs);
+
+/* as spi_sd_write_some_blocks() with a null buffer, but each block is the given word repeated, as
+ if from an array of it in memory. the dma reads the same word throughout, so no buffer is needed */
+int spi_sd_write_some_blocks_fill(const uint32_t fill, const unsigned long blocks);
+
 int spi_sd_write_blocks(const void * buf, const unsigned long blocks, const unsigned long long block_address);
 
-/* debug stuff */
-extern unsigned long last_successful_write_block_address;
+/* vectored variants, which transfer a list of buffers to or from consecutive blocks on the card
+ in a single cmd18 or cmd25, without copying them together first */
+struct spi_sd_read_segment {
+    void * buf;
+    unsigned long blocks;
+
+    /* if not null, receives the crc16 of each block in the segment, as computed by the dmac and
+     checked against the one sent by the card */
+    uint16_t * crcs;
+};
+
+struct spi_sd_write_segment {
+    /* may be null to write the fill word below repeated, zero unless otherwise specified */
+    const void * buf;
+    unsigned long blocks;
+    uint32_t fill;
+
+    /* if not null, receives the crc16 of each block as with spi_sd_write_some_blocks_with_crcs() */
+    uint16_t * crcs;
+};
+
+int spi_sd_read_blocks_vectored(const struct spi_sd_read_segment * segments, size_t count, unsigned long long block_address);
+int spi_sd_write_blocks_vectored(const struct spi_sd_write_segment * segments, size_t count, const unsigned long long block_address);
+
+/* read-side counterpart of an open multi-block write. opens a cmd18 at the given address, and
+ fills the given ring of 512-byte slots by dma while the consumer takes blocks from it in order.
+ the bus is held while the card is sending, which it stops doing, with a cmd12, once every slot
+ is full, resuming once half of them have been released or the consumer is waiting. as the bus
+ is held across calls, no other read or write of the card from the same task can complete
+ while the stream is open, and would wait forever, so the consumer must close the stream first.
+ returns -1 if a stream is already open, including one which failed and was not closed */
+int spi_sd_read_stream_open(void * ring, unsigned long ring_blocks, unsigned long long block_address);
+
+/* returns the next block, waiting for it if necessary, or null on error or if every slot has
+ been taken and not released. the block remains valid until released */
+const void * spi_sd_read_stream_take(void);
+
+/* releases the oldest taken block, making its slot available to be filled again */
+void spi_sd_read_stream_release(void);
+
+/* nonblocking, retires a block whose dma has finished and starts the next one if there is room,
+ returns -1 if the stream has failed. a main loop or background task calling this at least once
+ per block time keeps the card sending continuously until the ring is full */
+int spi_sd_read_stream_poll(void);
+
+/* stops the card if it is sending and gives up the bus. returns -1 if anything went wrong */
+int spi_sd_read_stream_close(void);
+
+/* if enabled, writes return once the card has accepted the data, and the wait for it to finish
+ programming is deferred until the next command. off by default */
+void spi_sd_set_lazy_busy(int enable);
+
+/* nonblocking, returns nonzero if the card is known to have finished programming the last
+ lazily written block. may be called from a background task to retire the wait early */
+int spi_sd_poll_ready(void);
+
+/* if nonzero, a read which has to wait for an open multi-block write is served once at most this
+ many more blocks have been written, by ending the cmd25, serving the read, and then resuming the
+ write with another cmd25. other writes wait until then. zero, the default, disables this */
+void spi_sd_set_read_latency_bound(unsigned long blocks);
+
+/* for layers above this one which serialize their own callers, so that a write may be preempted
+ on behalf of a reader waiting there rather than here */
+void spi_sd_reader_waiting(void);
+void spi_sd_reader_done_waiting(void);
+
+/* size of the card's allocation unit in blocks as learned during init, or zero if unknown.
+ multi-block writes are split into separate cmd25s at allocation unit boundaries */
+unsigned long spi_sd_au_blocks(void);
+
+/* capacity of the card in blocks as read from the csd during init, or zero if unknown */
+unsigned long long spi_sd_card_blocks(void);
+
+/* value of every byte of a block after it has been erased, either 0x00 or 0xFF */
+unsigned char spi_sd_erase_fill(void);
+
+/* erases the given range of blocks using cmd32, cmd33, and cmd38. blocking, calls yield() */
+int spi_sd_erase_blocks(unsigned long long block_address, unsigned long blocks);
+
+/* how many of the given blocks can be written starting at the given address without crossing
+ an allocation unit boundary, for callers that want to size their bursts to fit */
+unsigned long spi_sd_plan_burst(unsigned long long block_address, unsigned long blocks);
+
+/* health and efficiency counters, updated by this layer and by diskio.c */
+enum { SPI_SD_OP_INIT, SPI_SD_OP_READ, SPI_SD_OP_WRITE, SPI_SD_OP_ERASE, SPI_SD_OPS };
+
+struct spi_sd_stats {
+    /* block cache and deferred writes in diskio.c */
+    unsigned long cache_hits, cache_misses, cache_evictions;
+    unsigned long deferred_fill_sectors; /* of zeros or any other repeated 32-bit word */
+
+    /* retries of a failed operation by diskio.c, and how many of those were able to
+     reinitialize the card at a lower baud rate, indexed by SPI_SD_OP_* */
+    unsigned long retries[SPI_SD_OPS], baud_reductions[SPI_SD_OPS];
+
+    unsigned long read_crc_errors, write_crc_errors;
+
+    /* data response tokens after each written block, indexed by the three status bits, such
+     that 2 is accepted, 5 is crc error, and 6 is write error */
+    unsigned long data_responses[8];
+
+    unsigned long commands;
+    unsigned long long bytes_on_wire;
+
+    unsigned long long last_successful_write_block_address;
+};
+
+extern struct spi_sd_stats spi_sd_stats;
+
+void spi_sd_stats_get(struct spi_sd_stats * out);
+void spi_sd_stats_reset(void);
+
+/* if built with SPI_SD_DEADLINE defined, the time since this layer last yielded is measured by
+ the cycle counter throughout each operation, and loops which would otherwise spin without
+ yielding yield once it exceeds the limit for the phase they are in. the stretch is counted
+ from the start of the operation or the last yield, whichever is later */
+enum {
+    SPI_SD_PHASE_COMMAND, /* sending a command and polling for its response */
+    SPI_SD_PHASE_TOKEN, /* polling for the start of a data block */
+    SPI_SD_PHASE_TRANSFER, /* moving data blocks and their crcs and responses */
+    SPI_SD_PHASE_BUSY, /* waiting for the card to finish programming */
+    SPI_SD_PHASE_INIT, /* init and warm resume, outside of the above */
+    SPI_SD_PHASES
+};
+
+/* zero, the default, means no limit. SPI_SD_PHASES sets the limit for every phase */
+void spi_sd_set_phase_limit_us(unsigned phase, unsigned long us);
+
+struct spi_sd_phase_stats {
+    /* longest stretch seen without yielding that reached each phase, in microseconds, and how
+     many times each phase yielded only because its limit had been reached */
+    unsigned long worst_us[SPI_SD_PHASES];
+    unsigned long forced_yields[SPI_SD_PHASES];
+};
+
+void spi_sd_phase_stats_get(struct spi_sd_phase_stats * out);
+void spi_sd_phase_stats_reset(void);
+
+/* if built with SPI_SD_HEATMAP defined, where on the card writes land and how well they suit it.
+ a burst is the part of a cmd25 that falls within one allocation unit */
+#ifndef SPI_SD_HEATMAP_BINS
+#define SPI_SD_HEATMAP_BINS 32
+#endif
+#define SPI_SD_HEATMAP_LENGTHS 12
+
+struct spi_sd_heatmap {
+    /* allocation units per bin, chosen during init such that the bins span the whole card */
+    unsigned long aus_per_bin;
+
+    struct spi_sd_heatmap_bin {
+        /* sectors that fatfs asked diskio.c to write, and blocks actually sent to the card */
+        unsigned long logical_blocks, blocks;
+        unsigned long bursts;
+
+        /* blocks written over part of an allocation unit already written since it was last
+         opened, and bursts starting partway into an allocation unit not recently written */
+        unsigned long rewritten_blocks, misaligned_bursts;
+
+        /* cpu cycles spent waiting for the card to finish programming */
+        unsigned long long busy_cycles;
+    } bins[SPI_SD_HEATMAP_BINS];
+
+    /* bursts by length, bucket n holding those of 2^n to 2^(n+1) - 1 blocks, and the last
+     bucket also holding any longer ones */
+    struct spi_sd_heatmap_length {
+        unsigned long bursts, misaligned_bursts, rewritten_blocks;
+        unsigned long long busy_cycles;
+    } lengths[SPI_SD_HEATMAP_LENGTHS];
+
+    /* blocks written, and an estimate of those the card had to program, assuming it copies a
+     whole allocation unit for each misaligned burst or rewrite. the ratio of the two is the
+     write amplification */
+    unsigned long long blocks_written, blocks_programmed;
+};
+
+void spi_sd_heatmap_get(struct spi_sd_heatmap * out);
+void spi_sd_heatmap_reset(void);
+
+/* prints the nonzero parts of the above to stderr, one line per bin or bucket */
+void spi_sd_heatmap_dump(void);
+
+/* called by diskio.c for each write requested by fatfs, before caching or deferral */
+void spi_sd_heatmap_logical_write(unsigned long long block_address, unsigned long blocks);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,243 @@
+/* implementation of the samd51_sdcard.h interface on top of a disk image file, so that
+ diskio.c and the things layered on it can be exercised on a host */
+#include "samd51_sdcard.h"
+#include "sdcard_image.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+size_t sdcard_image_blocks_read = 0, sdcard_image_blocks_written = 0;
+size_t sdcard_image_read_commands = 0, sdcard_image_write_commands = 0;
+size_t sdcard_image_blocks_erased = 0, sdcard_image_erase_commands = 0;
+
+unsigned long sdcard_image_au_blocks = 0;
+unsigned char sdcard_image_erase_fill = 0;
+size_t sdcard_image_failing_writes = 0;
+
+static int fd = -1;
+
+struct spi_sd_stats spi_sd_stats = { 0 };
+
+void spi_sd_stats_get(struct spi_sd_stats * out) {
+    *out = spi_sd_stats;
+}
+
+void spi_sd_stats_reset(void) {
+    spi_sd_stats = (struct spi_sd_stats) { 0 };
+}
+
+#ifdef SPI_SD_HEATMAP
+/* there is no card whose behaviour would be worth accounting for, so the heatmap stays empty */
+void spi_sd_heatmap_get(struct spi_sd_heatmap * out) {
+    *out = (struct spi_sd_heatmap) { .aus_per_bin = 1 };
+}
+
+void spi_sd_heatmap_reset(void) { }
+void spi_sd_heatmap_dump(void) { }
+
+void spi_sd_heatmap_logical_write(unsigned long long block_address, unsigned long blocks) {
+    (void)block_address;
+    (void)blocks;
+}
+#endif
+
+extern void yield(void);
+__attribute((weak)) void yield(void) { }
+
+/* state of an open multi-block write, and the number of blocks since its cmd25 */
+static unsigned long long write_block_address;
+static unsigned long write_blocks_open;
+
+int sdcard_image_open(const char * path) {
+    fd = open(path, O_RDWR);
+    return -1 == fd ? -1 : 0;
+}
+
+void sdcard_image_close(void) {
+    if (fd != -1) close(fd);
+    fd = -1;
+}
+
+int spi_sd_init(unsigned baud_rate_reduction) {
+    (void)baud_rate_reduction;
+    return -1 == fd ? -1 : 0;
+}
+
+void spi_sd_shutdown(void) { }
+
+void spi_sd_restore_baud_rate(void) { }
+
+int spi_sd_resume(void) {
+    return -1 == fd ? -1 : 0;
+}
+
+int spi_sd_read_blocks(void * buf, unsigned long blocks, unsigned long long block_address) {
+    sdcard_image_read_commands++;
+    sdcard_image_blocks_read += blocks;
+
+    const ssize_t size = 512 * blocks;
+    unsigned char * out = buf;
+    ssize_t ret = pread(fd, out, size, 512 * block_address);
+    if (-1 == ret) return -1;
+
+    /* reading past the end of the image yields zeros rather than an error */
+    __builtin_memset(out + ret, 0, size - ret);
+    return 0;
+}
+
+int spi_sd_write_pre_erase(unsigned long blocks) {
+    (void)blocks;
+    return -1 == fd ? -1 : 0;
+}
+
+int spi_sd_write_blocks_start(unsigned long long block_address) {
+    sdcard_image_write_commands++;
+    write_block_address = block_address;
+    write_blocks_open = 0;
+
+    if (sdcard_image_failing_writes) {
+        sdcard_image_failing_writes--;
+        return -1;
+    }
+    return -1 == fd ? -1 : 0;
+}
+
+/* in place of the dmac, the same crc16 that the card uses for data blocks */
+static uint16_t crc16(const unsigned char * restrict const message, const size_t length) {
+    uint16_t crc = 0;
+
+    for (size_t ibyte = 0; ibyte < length; ibyte++) {
+        crc ^= message[ibyte] << 8U;
+
+        for (size_t ibit = 0; ibit < 8; ibit++)
+            crc = (crc & 0x8000u) ? (crc << 1) ^ 0x1021 : (crc << 1);
+    }
+
+    return crc;
+}
+
+static int write_some_blocks(const void * buf, const uint32_t fill, const unsigned long blocks, uint16_t * crcs) {
+    uint32_t filled[128];
+    for (size_t iword = 0; iword < 128; iword++)
+        filled[iword] = fill;
+
+    for (size_t iblock = 0; iblock < blocks; iblock++) {
+        /* the card layer ends the cmd25 and starts another at each allocation unit boundary */
+        if (sdcard_image_au_blocks && write_blocks_open && !(write_block_address % sdcard_image_au_blocks)) {
+            sdcard_image_write_commands++;
+            write_blocks_open = 0;
+        }
+
+        const unsigned char * block = buf ? (const unsigned char *)buf + 512 * iblock : (const unsigned char *)filled;
+        if (crcs) crcs[iblock] = crc16(block, 512);
+        if (pwrite(fd, block, 512, 512 * write_block_address) != 512) return -1;
+        write_block_address++;
+        write_blocks_open++;
+        sdcard_image_blocks_written++;
+    }
+
+    return 0;
+}
+
+int spi_sd_write_some_blocks_with_crcs(const void * buf, const unsigned long blocks, uint16_t * crcs) {
+    return write_some_blocks(buf, 0, blocks, crcs);
+}
+
+int spi_sd_write_some_blocks(const void * buf, const unsigned long blocks) {
+    return write_some_blocks(buf, 0, blocks, NULL);
+}
+
+int spi_sd_write_some_blocks_fill(const uint32_t fill, const unsigned long blocks) {
+    return write_some_blocks(NULL, fill, blocks, NULL);
+}
+
+void spi_sd_write_blocks_end(void) { }
+
+void spi_sd_set_lazy_busy(int enable) {
+    (void)enable;
+}
+
+int spi_sd_poll_ready(void) {
+    return 1;
+}
+
+void spi_sd_set_read_latency_bound(unsigned long blocks) {
+    (void)blocks;
+}
+
+void spi_sd_reader_waiting(void) { }
+
+void spi_sd_reader_done_waiting(void) { }
+
+unsigned long spi_sd_au_blocks(void) {
+    return sdcard_image_au_blocks;
+}
+
+unsigned long long spi_sd_card_blocks(void) {
+    const off_t size = lseek(fd, 0, SEEK_END);
+    return -1 == size ? 0 : (unsigned long long)size / 512;
+}
+
+unsigned char spi_sd_erase_fill(void) {
+    return sdcard_image_erase_fill;
+}
+
+int spi_sd_erase_blocks(unsigned long long block_address, unsigned long blocks) {
+    if (!blocks) return 0;
+    sdcard_image_erase_commands++;
+
+    unsigned char erased[512];
+    __builtin_memset(erased, sdcard_image_erase_fill, sizeof(erased));
+
+    for (unsigned long iblock = 0; iblock < blocks; iblock++) {
+        if (pwrite(fd, erased, 512, 512 * (block_address + iblock)) != 512) return -1;
+        sdcard_image_blocks_erased++;
+    }
+    return 0;
+}
+
+unsigned long spi_sd_plan_burst(unsigned long long block_address, unsigned long blocks) {
+    if (!sdcard_image_au_blocks) return blocks;
+
+    const unsigned long until_boundary = sdcard_image_au_blocks - block_address % sdcard_image_au_blocks;
+    return blocks < until_boundary ? blocks : until_boundary;
+}
+
+int spi_sd_write_blocks(const void * buf, const unsigned long blocks, const unsigned long long block_address) {
+    if (-1 == spi_sd_write_blocks_start(block_address) ||
+        -1 == spi_sd_write_some_blocks(buf, blocks))
+        return -1;
+
+    spi_sd_write_blocks_end();
+
+    return 0;
+}
+
+int spi_sd_read_blocks_vectored(const struct spi_sd_read_segment * segments, size_t count, unsigned long long block_address) {
+    for (size_t isegment = 0; isegment < count; isegment++) {
+        if (-1 == spi_sd_read_blocks(segments[isegment].buf, segments[isegment].blocks, block_address))
+            return -1;
+
+        if (segments[isegment].crcs)
+            for (size_t iblock = 0; iblock < segments[isegment].blocks; iblock++)
+                segments[isegment].crcs[iblock] = crc16((const unsigned char *)segments[isegment].buf + 512 * iblock, 512);
+
+        block_address += segments[isegment].blocks;
+    }
+
+    /* the card would have seen one command */
+    if (count) sdcard_image_read_commands -= count - 1;
+    return 0;
+}
+
+int spi_sd_write_blocks_vectored(const struct spi_sd_write_segment * segments, size_t count, const unsigned long long block_address) {
+    if (-1 == spi_sd_write_blocks_start(block_address)) return -1;
+
+    for (size_t isegment = 0; isegment < count; isegment++)
+        if (-1 == write_some_blocks(segments[isegment].buf, segments[isegment].fill, segments[isegment].blocks, segments[isegment].crcs))
+            return -1;
+
+    spi_sd_write_blocks_end();
+
+    return 0;
+}
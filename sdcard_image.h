@@ -0,0 +1,28 @@
+/* host-side stand-in for samd51_sdcard.c, backed by a disk image file instead of a card */
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* must be called before anything else, returns -1 if the image could not be opened */
+int sdcard_image_open(const char * path);
+void sdcard_image_close(void);
+
+/* what the card would have seen */
+extern size_t sdcard_image_blocks_read, sdcard_image_blocks_written;
+extern size_t sdcard_image_read_commands, sdcard_image_write_commands;
+extern size_t sdcard_image_blocks_erased, sdcard_image_erase_commands;
+
+/* properties of the card being stood in for, which change what diskio.c and the layers above
+ it send. the allocation unit size in blocks, zero if unknown, splits multi-block writes as on
+ the card, and the value of every byte after an erase is either 0x00 or 0xFF */
+extern unsigned long sdcard_image_au_blocks;
+extern unsigned char sdcard_image_erase_fill;
+
+/* the next this many write commands fail without writing anything, for exercising error paths */
+extern size_t sdcard_image_failing_writes;
+
+#ifdef __cplusplus
+}
+#endif
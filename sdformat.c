@@ -0,0 +1,44 @@
+/* formats the card the way the sd association's own formatter would: fat32 with 32 KiB
+ clusters up to 32 GiB, exfat with 128 or 256 KiB clusters above that, with the data area
+ and therefore every cluster starting on an allocation unit boundary. with FF_USE_TRIM
+ enabled, f_mkfs erases the whole volume with cmd38 first, and diskio.c erases rather than
+ writes any whole allocation units of zeros within the metadata regions */
+#include "sdformat.h"
+#include "diskio.h"
+
+#include "samd51_sdcard.h"
+
+#if !FF_USE_MKFS
+#error "FF_USE_MKFS must be enabled in ffconf.h"
+#endif
+
+FRESULT sd_format(void * work, UINT len) {
+    if (disk_initialize(0) & STA_NOINIT) return FR_NOT_READY;
+
+    /* this comes from the csd read during init */
+    LBA_t sectors;
+    if (disk_ioctl(0, GET_SECTOR_COUNT, &sectors) != RES_OK) return FR_DISK_ERR;
+
+    /* this is the largest power of two factor of the allocation unit size from the sd status */
+    DWORD align;
+    if (disk_ioctl(0, GET_BLOCK_SIZE, &align) != RES_OK) return FR_DISK_ERR;
+
+    /* if the allocation unit size is unknown, use 4 MiB, the typical value for sdhc cards */
+    if (align <= 1) align = 8192;
+
+    const MKFS_PARM opt = sectors <= 67108864 ? (MKFS_PARM) {
+        /* sdhc, up to 32 GiB */
+        .fmt = FM_FAT | FM_FAT32,
+        .n_fat = 2,
+        .align = align,
+        .au_size = 32768
+    } : (MKFS_PARM) {
+        /* sdxc */
+        .fmt = FM_EXFAT,
+        .n_fat = 1,
+        .align = align,
+        .au_size = sectors <= 1073741824 ? 131072 : 262144
+    };
+
+    return f_mkfs("", &opt, work, len);
+}
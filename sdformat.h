@@ -0,0 +1,14 @@
+/* on-device formatting of the card, laid out according to its own geometry */
+#include "ff.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* formats physical drive 0 as fat32 or exfat depending on capacity, with the data area
+ aligned to the card's allocation unit. work area should be at least a few sectors */
+FRESULT sd_format(void * work, UINT len);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,257 @@
+/* circular log of fixed-size slots within a contiguous region of the card. each slot holds a
+ record of up to SDLOG_SLOT_BLOCKS - 1 blocks followed by a trailer block with the sequence
+ number of the record and a crc of each of its blocks. the trailer is written last, so a slot
+ whose write was interrupted still has the trailer of its previous record or none at all, even
+ if the slot straddles an allocation unit boundary and is written as two cmd25s. records are
+ written to slots in order with consecutive sequence numbers, so the slots before the write head
+ are exactly those whose sequence number is that of slot zero plus their index, and the head can
+ be found by reading log2(slots) trailers */
+#include "sdlog.h"
+
+#include "samd51_sdcard.h"
+#include "coop_lock.h"
+
+#include <assert.h>
+#include <stdint.h>
+
+#define PAYLOAD_BLOCKS (SDLOG_SLOT_BLOCKS - 1)
+
+/* "SDLG" */
+#define SDLOG_MAGIC 0x474c4453
+
+union trailer {
+    struct {
+        uint32_t magic;
+
+        /* number of blocks in the record, the rest of the slot prior to the trailer is zeros */
+        uint32_t blocks;
+
+        uint64_t seq;
+
+        /* geometry of the log that wrote this, so that a trailer left behind by some other log
+         in an overlapping region is not mistaken for one belonging to this log */
+        uint64_t first_block;
+        uint32_t slots;
+
+        uint16_t crcs[PAYLOAD_BLOCKS];
+    };
+
+    /* the last two bytes are a crc of the rest, stored such that the crc of all 512 is zero */
+    uint32_t words[128];
+    unsigned char bytes[512];
+};
+
+static_assert(SDLOG_SLOT_BLOCKS >= 2 && 28 + 2 * PAYLOAD_BLOCKS <= 510, "SDLOG_SLOT_BLOCKS out of range");
+
+/* one trailer buffer shared by all logs, held for the duration of each call */
+static union trailer trailer;
+static struct coop_lock sdlog_lock;
+
+/* the same crc16 that the card uses for data blocks. only the trailer itself is checksummed
+ here, the crcs of the record being those the dmac computes on the way to and from the card */
+static uint16_t crc16(const unsigned char * restrict const message, const size_t length) {
+    uint16_t crc = 0;
+
+    for (size_t ibyte = 0; ibyte < length; ibyte++) {
+        crc ^= message[ibyte] << 8U;
+
+        for (size_t ibit = 0; ibit < 8; ibit++)
+            crc = (crc & 0x8000u) ? (crc << 1) ^ 0x1021 : (crc << 1);
+    }
+
+    return crc;
+}
+
+static unsigned long long slot_block(const struct sdlog * log, const unsigned long slot) {
+    return log->first_block + (unsigned long long)slot * SDLOG_SLOT_BLOCKS;
+}
+
+/* given the crc of the whole trailer block as read, which is zero if it is intact */
+static int trailer_is_valid(const struct sdlog * log, const uint16_t crc) {
+    return !crc && SDLOG_MAGIC == trailer.magic &&
+        trailer.first_block == log->first_block && trailer.slots == log->slots &&
+        trailer.blocks && trailer.blocks <= PAYLOAD_BLOCKS;
+}
+
+static int read_trailer(const struct sdlog * log, const unsigned long slot, uint16_t * crc) {
+    const struct spi_sd_read_segment segment = { .buf = trailer.words, .blocks = 1, .crcs = crc };
+    return spi_sd_read_blocks_vectored(&segment, 1, slot_block(log, slot) + PAYLOAD_BLOCKS);
+}
+
+/* returns 1 if the slot holds the record with the given sequence number, 0 if not, or -1 if the
+ trailer could not be read */
+static int slot_holds(const struct sdlog * log, const unsigned long slot, const unsigned long long seq) {
+    uint16_t crc;
+    if (-1 == read_trailer(log, slot, &crc)) return -1;
+    return trailer_is_valid(log, crc) && trailer.seq == seq;
+}
+
+static int attach_unlocked(struct sdlog * log, unsigned long long first_block, unsigned long long blocks) {
+    *log = (struct sdlog) { .first_block = first_block, .slots = blocks / SDLOG_SLOT_BLOCKS };
+    if (!log->slots) return -1;
+
+    uint16_t crc;
+    if (-1 == read_trailer(log, 0, &crc)) return -1;
+
+    /* if slot zero has never been written, the log is empty */
+    if (!trailer_is_valid(log, crc) || trailer.seq % log->slots) return 0;
+    const unsigned long long seq_first = trailer.seq;
+
+    /* invariant: slots before lo were written in the same lap as slot zero, and slots from hi
+     onward were not. if all were, the head has wrapped around to slot zero */
+    unsigned long lo = 1, hi = log->slots;
+    while (lo < hi) {
+        const unsigned long mid = lo + (hi - lo) / 2;
+        const int ret = slot_holds(log, mid, seq_first + mid);
+        if (-1 == ret) return -1;
+
+        if (ret) lo = mid + 1;
+        else hi = mid;
+    }
+
+    log->seq = seq_first + lo;
+    return 0;
+}
+
+int sdlog_attach(struct sdlog * log, unsigned long long first_block, unsigned long long blocks) {
+    coop_lock_take(&sdlog_lock);
+    const int ret = attach_unlocked(log, first_block, blocks);
+    coop_lock_give(&sdlog_lock);
+    return ret;
+}
+
+/* location on the card of a file which is known to occupy a single run of clusters */
+static int region_of_file(FIL * fp, unsigned long long * first_block, unsigned long long * blocks) {
+    const FATFS * fs = fp->obj.fs;
+    if (fp->obj.sclust < 2) return -1;
+
+    *first_block = fs->database + (unsigned long long)fs->csize * (fp->obj.sclust - 2);
+    *blocks = f_size(fp) / 512;
+    return 0;
+}
+
+int sdlog_open(struct sdlog * log, FIL * fp) {
+    unsigned long long first_block, blocks;
+    if (-1 == region_of_file(fp, &first_block, &blocks)) return -1;
+
+    return sdlog_attach(log, first_block, blocks);
+}
+
+int sdlog_create(struct sdlog * log, FIL * fp, FSIZE_t size) {
+    /* allocate now, as one contiguous run of clusters, or fail */
+    if (f_expand(fp, size, 1) != FR_OK) return -1;
+
+    unsigned long long first_block, blocks;
+    if (-1 == region_of_file(fp, &first_block, &blocks)) return -1;
+
+    *log = (struct sdlog) { .first_block = first_block, .slots = blocks / SDLOG_SLOT_BLOCKS };
+    if (!log->slots) return -1;
+
+    /* f_expand leaves the FAT and directory entry in the window and possibly a deferred run in
+     diskio.c, which must reach the card before the raw erase below, lest they be written
+     afterward over part of the erased region or never */
+    if (f_sync(fp) != FR_OK) return -1;
+
+    /* get rid of any trailers left behind in this region by a previous log */
+    return spi_sd_erase_blocks(first_block, (unsigned long long)log->slots * SDLOG_SLOT_BLOCKS);
+}
+
+/* next block of the slot being appended, the end of the slot, and how many more blocks fit in
+ the current cmd25 before an allocation unit boundary */
+static unsigned long long append_block, append_end;
+static unsigned long append_burst;
+
+static int append_start(const unsigned long long block) {
+    append_block = block;
+    append_end = block + SDLOG_SLOT_BLOCKS;
+    append_burst = spi_sd_plan_burst(block, SDLOG_SLOT_BLOCKS);
+    return spi_sd_write_blocks_start(block);
+}
+
+/* continues the slot, ending the cmd25 and starting another at an allocation unit boundary,
+ so that a slot which straddles one is written as two bursts, each within a single unit */
+static int append_some_blocks(const void * buf, unsigned long blocks, uint16_t * crcs) {
+    const unsigned char * cursor = buf;
+
+    while (blocks) {
+        if (!append_burst) {
+            spi_sd_write_blocks_end();
+            append_burst = spi_sd_plan_burst(append_block, append_end - append_block);
+            if (-1 == spi_sd_write_blocks_start(append_block)) return -1;
+        }
+
+        const unsigned long now = blocks < append_burst ? blocks : append_burst;
+        if (-1 == (crcs ? spi_sd_write_some_blocks_with_crcs(cursor, now, crcs) :
+                   spi_sd_write_some_blocks(cursor, now)))
+            return -1;
+
+        if (cursor) cursor += 512 * now;
+        if (crcs) crcs += now;
+        blocks -= now;
+        append_burst -= now;
+        append_block += now;
+    }
+
+    return 0;
+}
+
+int sdlog_append(struct sdlog * log, const void * data, unsigned long blocks) {
+    if (!blocks || blocks > PAYLOAD_BLOCKS || !log->slots) return -1;
+
+    coop_lock_take(&sdlog_lock);
+
+    trailer = (union trailer) { {
+        .magic = SDLOG_MAGIC,
+        .blocks = blocks,
+        .seq = log->seq,
+        .first_block = log->first_block,
+        .slots = log->slots
+    } };
+
+    /* record, zeros for the unused part of the slot, then the trailer, in one cmd25 unless the
+     slot straddles an allocation unit boundary. the crcs of the record are filled in by the dmac
+     as it goes out, before the trailer is finished */
+    int ret = -1;
+    if (-1 != append_start(slot_block(log, log->seq % log->slots)) &&
+        -1 != append_some_blocks(data, blocks, trailer.crcs) &&
+        -1 != append_some_blocks(NULL, PAYLOAD_BLOCKS - blocks, NULL)) {
+        const uint16_t crc = crc16(trailer.bytes, 510);
+        trailer.bytes[510] = crc >> 8;
+        trailer.bytes[511] = crc & 0xFF;
+
+        if (-1 != append_some_blocks(trailer.words, 1, NULL)) {
+            spi_sd_write_blocks_end();
+            log->seq++;
+            ret = 0;
+        }
+    }
+
+    coop_lock_give(&sdlog_lock);
+    return ret;
+}
+
+long sdlog_read(const struct sdlog * log, unsigned long long seq, void * buf) {
+    /* not yet written, or already overwritten */
+    if (seq >= log->seq || log->seq - seq > log->slots) return -1;
+
+    coop_lock_take(&sdlog_lock);
+
+    uint16_t crcs[PAYLOAD_BLOCKS], trailer_crc;
+    const struct spi_sd_read_segment segments[2] = {
+        { .buf = buf, .blocks = PAYLOAD_BLOCKS, .crcs = crcs },
+        { .buf = trailer.words, .blocks = 1, .crcs = &trailer_crc }
+    };
+
+    long ret = -1;
+    if (-1 != spi_sd_read_blocks_vectored(segments, 2, slot_block(log, seq % log->slots)) &&
+        trailer_is_valid(log, trailer_crc) && trailer.seq == seq) {
+        ret = trailer.blocks;
+
+        for (size_t iblock = 0; iblock < trailer.blocks; iblock++)
+            if (crcs[iblock] != trailer.crcs[iblock])
+                ret = -1;
+    }
+
+    coop_lock_give(&sdlog_lock);
+    return ret;
+}
@@ -0,0 +1,46 @@
+/* fixed-size circular log of records in a preallocated contiguous file, written directly to the
+ card without going through fatfs or the block cache once the file has been set up */
+#include "ff.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* each slot is this many blocks, the last of which is a trailer describing the others */
+#ifndef SDLOG_SLOT_BLOCKS
+#define SDLOG_SLOT_BLOCKS 8
+#endif
+
+struct sdlog {
+    /* first block of the region on the card, and how many slots fit within it */
+    unsigned long long first_block;
+    unsigned long slots;
+
+    /* sequence number of the next record, which will be written to slot seq % slots */
+    unsigned long long seq;
+};
+
+/* expands an empty file opened for writing to the given size as one contiguous run of clusters,
+ erases it, and sets up an empty log within it */
+int sdlog_create(struct sdlog * log, FIL * fp, FSIZE_t size);
+
+/* locates an existing log within a file previously set up with sdlog_create, and finds where
+ writing left off by binary search over the slot trailers */
+int sdlog_open(struct sdlog * log, FIL * fp);
+
+/* as above, given the location and size of the region on the card in blocks */
+int sdlog_attach(struct sdlog * log, unsigned long long first_block, unsigned long long blocks);
+
+/* writes one record of up to SDLOG_SLOT_BLOCKS - 1 blocks into the next slot as a single cmd25,
+ or two if the slot straddles an allocation unit boundary, overwriting the oldest record once
+ the log is full */
+int sdlog_append(struct sdlog * log, const void * data, unsigned long blocks);
+
+/* reads the record with the given sequence number, if it has not yet been overwritten, into a
+ buffer of SDLOG_SLOT_BLOCKS - 1 blocks. returns the number of blocks in the record, or -1 if
+ the record is gone or fails its crc check */
+long sdlog_read(const struct sdlog * log, unsigned long long seq, void * buf);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,109 @@
+/* host-side test of the circular log against a scratch image, covering recovery of the write
+ head from every position, interrupted appends, crc checks, and slots straddling an allocation
+ unit boundary. exits nonzero on failure. build e.g. with:
+ cc -O2 -Ipath/to/fatfs/source sdlog_test.c sdlog.c sdcard_image.c -o sdlog_test && ./sdlog_test */
+#include "sdlog.h"
+#include "samd51_sdcard.h"
+#include "sdcard_image.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define FIRST_BLOCK 1000
+#define SLOTS 10
+#define PAYLOAD_BLOCKS (SDLOG_SLOT_BLOCKS - 1)
+
+static size_t failures = 0;
+
+#define CHECK(cond) do { if (!(cond)) { fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); failures++; } } while(0)
+
+/* only sdlog_create and sdlog_open go through fatfs, and neither is exercised here */
+FRESULT f_expand(FIL * fp, FSIZE_t size, BYTE opt) { (void)fp; (void)size; (void)opt; return FR_INT_ERR; }
+FRESULT f_sync(FIL * fp) { (void)fp; return FR_INT_ERR; }
+
+static unsigned char record[PAYLOAD_BLOCKS * 512], readback[PAYLOAD_BLOCKS * 512];
+
+/* each record is filled with its sequence number and has between one and PAYLOAD_BLOCKS blocks */
+static unsigned long record_blocks(const unsigned long long seq) {
+    return 1 + seq % PAYLOAD_BLOCKS;
+}
+
+static void check_record(const struct sdlog * log, const unsigned long long seq) {
+    CHECK(sdlog_read(log, seq, readback) == (long)record_blocks(seq));
+    for (size_t ibyte = 0; ibyte < 512 * record_blocks(seq); ibyte++)
+        if (readback[ibyte] != (unsigned char)seq) {
+            CHECK(readback[ibyte] == (unsigned char)seq);
+            break;
+        }
+}
+
+static void append_and_recover(struct sdlog * log, const unsigned long long records) {
+    for (unsigned long long seq = 0; seq < records; seq++) {
+        memset(record, (unsigned char)seq, sizeof(record));
+        CHECK(0 == sdlog_append(log, record, record_blocks(seq)));
+
+        /* a fresh attach finds the head wherever it is, including just after wrapping */
+        struct sdlog recovered;
+        CHECK(0 == sdlog_attach(&recovered, FIRST_BLOCK, SLOTS * SDLOG_SLOT_BLOCKS));
+        CHECK(recovered.seq == log->seq);
+    }
+}
+
+int main(void) {
+    char path[] = "/tmp/sdlog_test_XXXXXX";
+    const int fd = mkstemp(path);
+    if (-1 == fd || ftruncate(fd, 512 * (FIRST_BLOCK + SLOTS * SDLOG_SLOT_BLOCKS)) != 0 || -1 == sdcard_image_open(path)) {
+        perror(path);
+        return 1;
+    }
+    close(fd);
+
+    struct sdlog log;
+    CHECK(0 == sdlog_attach(&log, FIRST_BLOCK, SLOTS * SDLOG_SLOT_BLOCKS));
+    CHECK(0 == log.seq && SLOTS == log.slots);
+
+    append_and_recover(&log, 3 * SLOTS + 7);
+    CHECK(3 * SLOTS + 7 == log.seq);
+
+    /* the last lap is readable, anything older or not yet written is not */
+    for (unsigned long long seq = log.seq - SLOTS; seq < log.seq; seq++)
+        check_record(&log, seq);
+    CHECK(-1 == sdlog_read(&log, log.seq - SLOTS - 1, readback));
+    CHECK(-1 == sdlog_read(&log, log.seq, readback));
+
+    /* a record whose payload is damaged fails its crc check */
+    const unsigned long long damaged = log.seq - 2;
+    const unsigned char junk[512] = { 1 };
+    CHECK(0 == spi_sd_write_blocks(junk, 1, FIRST_BLOCK + (damaged % SLOTS) * SDLOG_SLOT_BLOCKS));
+    CHECK(-1 == sdlog_read(&log, damaged, readback));
+
+    /* an append interrupted before its trailer leaves the head where it was, and the record
+     it was overwriting unreadable */
+    const unsigned long long overwritten = log.seq - SLOTS;
+    CHECK(0 == spi_sd_write_blocks(junk, 1, FIRST_BLOCK + (log.seq % SLOTS) * SDLOG_SLOT_BLOCKS));
+    struct sdlog recovered;
+    CHECK(0 == sdlog_attach(&recovered, FIRST_BLOCK, SLOTS * SDLOG_SLOT_BLOCKS));
+    CHECK(recovered.seq == log.seq);
+    CHECK(-1 == sdlog_read(&recovered, overwritten, readback));
+
+    /* with allocation units of 12 blocks, slots 2, 5 and 8 straddle a boundary and are each
+     written as two cmd25s, and everything still reads back and recovers */
+    CHECK(0 == spi_sd_erase_blocks(FIRST_BLOCK, SLOTS * SDLOG_SLOT_BLOCKS));
+    sdcard_image_au_blocks = 12;
+    CHECK(0 == sdlog_attach(&log, FIRST_BLOCK, SLOTS * SDLOG_SLOT_BLOCKS));
+    CHECK(0 == log.seq);
+
+    const size_t commands_before = sdcard_image_write_commands;
+    append_and_recover(&log, SLOTS);
+    CHECK(SLOTS + 3 == sdcard_image_write_commands - commands_before);
+    for (unsigned long long seq = 0; seq < SLOTS; seq++)
+        check_record(&log, seq);
+
+    sdcard_image_close();
+    unlink(path);
+
+    if (failures) fprintf(stderr, "%zu failures\n", failures);
+    return failures ? 1 : 0;
+}
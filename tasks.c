@@ -0,0 +1,163 @@
+/* small round-robin runtime of stackful cooperative tasks, providing a strong yield(). on the
+ samd51 the context switch is a few instructions of assembly, on a host it uses ucontext */
+#include "tasks.h"
+
+#include <stdint.h>
+
+#if defined(__arm__)
+#if __has_include(<samd51.h>)
+/* newer cmsis-atmel from upstream */
+#include <samd51.h>
+#else
+/* older cmsis-atmel from adafruit */
+#include <samd.h>
+#endif
+#else
+#include <ucontext.h>
+#endif
+
+#ifndef TASKS_MAX
+#define TASKS_MAX 4
+#endif
+
+enum { TASK_FREE = 0, TASK_RUNNING, TASK_DONE };
+
+static struct task {
+#if defined(__arm__)
+    void * sp;
+#else
+    ucontext_t context;
+#endif
+    void (* func)(void *);
+    void * arg;
+    unsigned char state;
+} tasks[TASKS_MAX];
+
+/* null when the scheduler, or code outside of tasks_run(), is running */
+static struct task * current = NULL;
+
+#if defined(__arm__)
+static void * scheduler_sp;
+
+/* saves callee-saved state on the current stack, stores the stack pointer, and resumes
+ whatever was saved in the same way on the other stack. interrupts taken while a task is
+ running are stacked on that task's stack, which must be sized accordingly */
+__attribute((naked, noinline)) static void switch_stack(void ** save, void * restore) {
+    (void)save;
+    (void)restore;
+    __asm volatile(
+                   "push {r4-r11, lr}\n"
+#if defined(__ARM_FP)
+                   "vpush {s16-s31}\n"
+#endif
+                   "str sp, [r0]\n"
+                   "mov sp, r1\n"
+#if defined(__ARM_FP)
+                   "vpop {s16-s31}\n"
+#endif
+                   "pop {r4-r11, pc}\n");
+}
+
+#else
+static ucontext_t scheduler_context;
+#endif
+
+static void switch_to_scheduler(struct task * task) {
+#if defined(__arm__)
+    switch_stack(&task->sp, scheduler_sp);
+#else
+    swapcontext(&task->context, &scheduler_context);
+#endif
+}
+
+static void switch_to_task(struct task * task) {
+#if defined(__arm__)
+    switch_stack(&scheduler_sp, task->sp);
+#else
+    swapcontext(&scheduler_context, &task->context);
+#endif
+}
+
+static void trampoline(void) {
+    struct task * task = current;
+    task->func(task->arg);
+    task->state = TASK_DONE;
+
+    /* never resumed */
+    switch_to_scheduler(task);
+}
+
+int task_start(void (* func)(void *), void * arg, void * stack, size_t stack_size) {
+    struct task * task = NULL;
+    for (size_t itask = 0; itask < TASKS_MAX && !task; itask++)
+        if (TASK_RUNNING != tasks[itask].state) task = tasks + itask;
+    if (!task) return -1;
+
+    task->func = func;
+    task->arg = arg;
+
+#if defined(__arm__)
+    /* lay out a frame such that the first switch to this task pops into the trampoline with
+     the stack pointer 8-byte aligned at the top of the given stack */
+#if defined(__ARM_FP)
+    const size_t frame_words = 16 + 9;
+#else
+    const size_t frame_words = 9;
+#endif
+    uint32_t * top = (uint32_t *)(((uintptr_t)stack + stack_size) & ~(uintptr_t)7);
+    uint32_t * frame = top - frame_words;
+    for (size_t iword = 0; iword < frame_words; iword++)
+        frame[iword] = 0;
+    frame[frame_words - 1] = (uint32_t)(uintptr_t)trampoline;
+    task->sp = frame;
+#else
+    getcontext(&task->context);
+    task->context.uc_stack.ss_sp = stack;
+    task->context.uc_stack.ss_size = stack_size;
+    task->context.uc_link = NULL;
+    makecontext(&task->context, trampoline, 0);
+#endif
+
+    task->state = TASK_RUNNING;
+    return 0;
+}
+
+void yield(void) {
+    if (current) switch_to_scheduler(current);
+}
+
+void task_notify_from_isr(void) {
+#if defined(__arm__)
+    __SEV();
+#endif
+}
+
+/* called from DMAC_2_Handler, overriding the weak stub in samd51_sdcard.c */
+void spi_sd_dma_interrupt_hook(void) {
+    task_notify_from_isr();
+}
+
+void tasks_run(void) {
+    while (1) {
+        size_t running = 0;
+        for (size_t itask = 0; itask < TASKS_MAX; itask++) {
+            struct task * task = tasks + itask;
+            if (TASK_RUNNING != task->state) continue;
+            running++;
+
+            current = task;
+            switch_to_task(task);
+            current = NULL;
+        }
+
+        if (!running) return;
+
+#if defined(__arm__)
+        /* every task has yielded once since the last time through here. tasks that are polling
+         something call __SEV() prior to yield(), as does coop_lock_give() on behalf of tasks
+         waiting for the lock, so this only sleeps if none of them did so and no interrupt has
+         happened since */
+        __WFE();
+#endif
+    }
+}
@@ -0,0 +1,25 @@
+/* optional cooperative task runtime. linking tasks.c replaces the weak yield() stub, so that
+ other tasks run whenever the sd card code waits on the card or on dma */
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* stack must be 8-byte aligned and outlive the task. returns -1 if there is no free slot */
+int task_start(void (* func)(void *), void * arg, void * stack, size_t stack_size);
+
+/* runs tasks until all of them have returned. the calling context sleeps whenever a full pass
+ over the tasks finds none of them able to make progress */
+void tasks_run(void);
+
+/* switches to the next task, or does nothing if called outside of a task */
+void yield(void);
+
+/* call from any isr whose completion a task may be waiting on, to make sure the scheduler
+ does not sleep through it. the dma completion interrupt in samd51_sdcard.c does this */
+void task_notify_from_isr(void);
+
+#ifdef __cplusplus
+}
+#endif